@@ -0,0 +1,15 @@
+#ifndef __COPY_H__
+#define __COPY_H__
+
+#include <types.h>
+
+// Non-SONY: copying is pipelined: while the writer thread writes one buffer, the next one is read into another.
+// Reads or writes count sectors at sector of unit. Returns 0, or a negative error code.
+typedef int (*copy_io_t)(void *device, void *buffer, u32 unit, u32 sector, u32 count, int write);
+
+int CopyInit(const char *name, copy_io_t io);
+void CopyPostWrite(void *device, void *buffer, u32 unit, u32 sector, u32 count, void *verifyBuffer, u32 crc);
+int CopyWaitWrite(void);
+void *CopyGetWriteBuffer(void);
+
+#endif
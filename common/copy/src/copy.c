@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <stdio.h>
+#include <thbase.h>
+#include <thevent.h>
+
+#include "crc32.h"
+#include "copy.h"
+
+struct CopyRequest
+{
+    void *device;
+    void *buffer;
+    u32 unit;
+    u32 sector;
+    u32 count;          // In sectors.
+    void *verifyBuffer; // NULL to not read the data back.
+    u32 crc;            // Of the data read from the source.
+    int result;
+};
+
+static const char *CopyName;
+static copy_io_t CopyIO;
+static int CopyWriterThreadID;
+static int CopyRequestEvfID;
+static int CopyDoneEvfID;
+static struct CopyRequest CopyRequest;
+
+// Writes the buffer, then reads it back and checks it against the CRC of the data that was read. A buffer that does not match is written once more.
+static int CopyWrite(struct CopyRequest *request)
+{
+    int result, retries;
+
+    for (retries = 0; retries < 2; retries++) {
+        if ((result = CopyIO(request->device, request->buffer, request->unit, request->sector, request->count, 1)) < 0)
+            return result;
+        if (request->verifyBuffer == NULL)
+            return 0;
+
+        if ((result = CopyIO(request->device, request->verifyBuffer, request->unit, request->sector, request->count, 0)) < 0)
+            return result;
+        if (Crc32(0, request->verifyBuffer, request->count * 512) == request->crc)
+            return 0;
+
+        printf("%s: error: verify failed at %lu:%08lx.\n", CopyName, request->unit, request->sector);
+    }
+
+    return -EIO;
+}
+
+// Reading the next buffer overlaps with writing and reading back the previous one.
+static void CopyWriterThread(void *arg)
+{
+    u32 bits;
+
+    while (1) {
+        WaitEventFlag(CopyRequestEvfID, 1, WEF_CLEAR | WEF_OR, &bits);
+        CopyRequest.result = CopyWrite(&CopyRequest);
+        SetEventFlag(CopyDoneEvfID, 1);
+    }
+}
+
+int CopyInit(const char *name, copy_io_t io)
+{
+    iop_event_t EventFlagData;
+    iop_thread_t ThreadData;
+
+    CopyName = name;
+    CopyIO   = io;
+
+    EventFlagData.attr = EA_MULTI;
+    EventFlagData.bits = 0;
+    if ((CopyRequestEvfID = CreateEventFlag(&EventFlagData)) < 0 || (CopyDoneEvfID = CreateEventFlag(&EventFlagData)) < 0)
+        return -ENOMEM;
+
+    ThreadData.attr      = TH_C;
+    ThreadData.thread    = &CopyWriterThread;
+    ThreadData.priority  = 0x7b;
+    ThreadData.stacksize = 0x800;
+    if ((CopyWriterThreadID = CreateThread(&ThreadData)) < 0 || StartThread(CopyWriterThreadID, NULL) < 0)
+        return -ENOMEM;
+
+    return 0;
+}
+
+// Hands the buffer to the writer thread. CopyWaitWrite() must be called before the next one is posted.
+void CopyPostWrite(void *device, void *buffer, u32 unit, u32 sector, u32 count, void *verifyBuffer, u32 crc)
+{
+    CopyRequest.device       = device;
+    CopyRequest.buffer       = buffer;
+    CopyRequest.unit         = unit;
+    CopyRequest.sector       = sector;
+    CopyRequest.count        = count;
+    CopyRequest.verifyBuffer = verifyBuffer;
+    CopyRequest.crc          = crc;
+    SetEventFlag(CopyRequestEvfID, 1);
+}
+
+int CopyWaitWrite(void)
+{
+    u32 bits;
+
+    WaitEventFlag(CopyDoneEvfID, 1, WEF_CLEAR | WEF_OR, &bits);
+    if (CopyRequest.result < 0)
+        printf("%s: error: write failed at %lu:%08lx.\n", CopyName, CopyRequest.unit, CopyRequest.sector);
+
+    return CopyRequest.result;
+}
+
+// Returns the buffer of the last write that was posted.
+void *CopyGetWriteBuffer(void)
+{
+    return CopyRequest.buffer;
+}
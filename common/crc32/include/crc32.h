@@ -0,0 +1,10 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <types.h>
+
+// Non-SONY: table-driven CRC32 (IEEE 802.3), for verifying copies.
+void Crc32Init(void);
+u32 Crc32(u32 crc, const void *buffer, u32 size);
+
+#endif
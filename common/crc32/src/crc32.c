@@ -0,0 +1,33 @@
+#include <types.h>
+
+#include "crc32.h"
+
+static u32 Crc32Table[256];
+
+void Crc32Init(void)
+{
+    u32 crc, i, j;
+
+    for (i = 0; i < 256; i++) {
+        for (crc = i, j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        Crc32Table[i] = crc;
+    }
+}
+
+u32 Crc32(u32 crc, const void *buffer, u32 size)
+{
+    const u8 *p;
+
+    crc = ~crc;
+    for (p = buffer; size >= 4; size -= 4, p += 4) {
+        crc = Crc32Table[(crc ^ p[0]) & 0xFF] ^ (crc >> 8);
+        crc = Crc32Table[(crc ^ p[1]) & 0xFF] ^ (crc >> 8);
+        crc = Crc32Table[(crc ^ p[2]) & 0xFF] ^ (crc >> 8);
+        crc = Crc32Table[(crc ^ p[3]) & 0xFF] ^ (crc >> 8);
+    }
+    for (; size > 0; size--, p++)
+        crc = Crc32Table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
@@ -16,6 +16,8 @@
 
 // Sectors for this and that ;)
 #define APA_SECTOR_MBR          0
+#define APA_SECTOR_HDCK_DIGEST  4 // Non-SONY: digest of the partition table, as of the last clean hdck run.
+#define APA_SECTOR_HDSK_JOURNAL 5 // Non-SONY: progress of the partition that hdsk is moving.
 #define APA_SECTOR_SECTOR_ERROR 6 // use for last sector that had a error...
 #define APA_SECTOR_PART_ERROR   7 // use for last partition that had a error...
 #define APA_SECTOR_APAL         8
@@ -140,6 +142,7 @@ int apaCacheFlushAllDirty(s32 device);
 apa_cache_t *apaCacheGetHeader(s32 device, u32 sector, u32 mode, int *err);
 void apaCacheFree(apa_cache_t *clink);
 apa_cache_t *apaCacheAlloc(void);
+void apaCacheInvalidate(s32 device);
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -179,4 +182,40 @@ typedef struct
 
 int apaGetFreeSectors(s32 device, u32 *free, apa_device_t *deviceinfo);
 
+///////////////////////////////////////////////////////////////////////////////
+// Non-SONY: in-memory index of the partitions, kept current whenever a header is written.
+
+#define APA_INDEX_NONE    0xFFFF
+#define APA_INDEX_CLASSES 32 // Free partitions are grouped by log2 of their size.
+
+typedef struct
+{
+    u32 start;
+    u32 length;
+    u32 idHash;
+    u16 type;
+    u16 flags;
+    u16 idNext;   // Next main partition in the same ID bucket.
+    u16 freeNext; // Next/previous free partition in the same size class.
+    u16 freePrev;
+    u16 nsub;
+} apa_index_entry_t;
+
+int apaIndexBuild(s32 device);
+void apaIndexInvalidate(s32 device);
+int apaIndexIsValid(s32 device);
+void apaIndexUpdate(s32 device, const apa_header_t *header);
+int apaIndexSizeClass(u32 length);
+u32 apaIndexGetCount(s32 device);
+const apa_index_entry_t *apaIndexGetEntry(s32 device, u32 pos);
+int apaIndexGetFreeClasses(s32 device, u32 *total, u32 *counts);
+const apa_index_entry_t *apaIndexFindStart(s32 device, u32 start);
+const apa_index_entry_t *apaIndexFindFree(s32 device, u32 length);
+apa_cache_t *apaIndexFindId(s32 device, const char *id, int *err);
+
+// Non-SONY: FNV-1a, for the ID index and the digests of hdck and hdsk.
+#define APA_HASH_INIT 0x811C9DC5
+
+u32 apaHash(u32 hash, const void *buffer, u32 size);
+
 #endif /* __LIBAPA_H__ */
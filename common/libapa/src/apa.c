@@ -69,6 +69,25 @@ int apaGetPartErrorName(s32 device, char *name)
 
     if ((rv = apaGetPartErrorSector(device, APA_SECTOR_PART_ERROR, &lba)) <= 0)
         return rv;
+
+    if (apaIndexIsValid(device)) {
+        const apa_index_entry_t *entry;
+
+        if ((entry = apaIndexFindStart(device, lba)) != NULL && entry->type != APA_TYPE_FREE && !(entry->flags & APA_FLAG_SUB)) {
+            if (!(clink = apaCacheGetHeader(device, lba, APA_IO_MODE_READ, &rv)))
+                return rv;
+            if (name) {
+                strncpy(name, clink->header->id, APA_IDMAX - 1);
+                name[APA_IDMAX - 1] = '\0';
+            }
+            apaCacheFree(clink);
+            return 1;
+        }
+
+        apaSetPartErrorSector(device, 0);
+        return 0;
+    }
+
     if (!(clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &rv)))
         return rv;
 
@@ -160,6 +179,9 @@ apa_cache_t *apaFindPartition(s32 device, const char *id, int *err)
 {
     apa_cache_t *clink;
 
+    if (apaIndexIsValid(device))
+        return apaIndexFindId(device, id, err);
+
     clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, err);
     while (clink) {
         if (!(clink->header->flags & APA_FLAG_SUB)) {
@@ -79,7 +79,8 @@ int apaCacheTransfer(apa_cache_t *clink, int type)
                    err, clink->device, clink->sector, type);
         if (type == 0) // save any read error's..
             apaSaveError(clink->device, clink->header, APA_SECTOR_SECTOR_ERROR, clink->sector);
-    }
+    } else if (type)
+        apaIndexUpdate(clink->device, clink->header);
     clink->flags &= ~APA_CACHE_FLAG_DIRTY;
     return err;
 }
@@ -173,6 +174,19 @@ void apaCacheFree(apa_cache_t *clink)
     return;
 }
 
+// Non-SONY: drops the unused headers of the device, after another driver has written to the partition table.
+void apaCacheInvalidate(s32 device)
+{
+    int i;
+
+    for (i = 1; i < cacheSize + 1; i++) {
+        if (cacheBuf[i].device == device && cacheBuf[i].nused == 0 && !(cacheBuf[i].flags & APA_CACHE_FLAG_DIRTY)) {
+            cacheBuf[i].device = -1;
+            cacheBuf[i].sector = -1;
+        }
+    }
+}
+
 apa_cache_t *apaCacheAlloc(void)
 {
     apa_cache_t *cnext;
@@ -42,13 +42,25 @@ static void apaCalculateFreeSpace(u32 *free, u32 sectors)
 
 int apaGetFreeSectors(s32 device, u32 *free, apa_device_t *deviceinfo)
 {
-    u32 sectors, partMax;
-    int rv;
+    u32 sectors, partMax, counts[APA_INDEX_CLASSES];
+    int rv, i;
+    u32 j;
     apa_cache_t *clink;
 
     sectors = 0;
     *free   = 0;
-    if ((clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &rv)) != NULL) {
+    rv      = 0;
+    if (apaIndexIsValid(device) && apaIndexGetFreeClasses(device, &sectors, counts) == 0) {
+        for (i = 0; i < APA_INDEX_CLASSES; i++) {
+            if (0x1FFFFF < ((u32)1 << i))
+                *free += counts[i] << i;
+            else {
+                // Below 0x200000 sectors, the result only depends on whether a size occurs at all, or more than once.
+                for (j = 0; j < counts[i] && j < 2; j++)
+                    apaCalculateFreeSpace(free, (u32)1 << i);
+            }
+        }
+    } else if ((clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &rv)) != NULL) {
         do {
             if (clink->header->type == 0)
                 apaCalculateFreeSpace(free, clink->header->length);
@@ -0,0 +1,431 @@
+/*
+# _____     ___ ____     ___ ____
+#  ____|   |    ____|   |        | |____|
+# |     ___|   |____ ___|    ____| |    \    PS2DEV Open Source Project.
+#-----------------------------------------------------------------------
+# Copyright 2001-2004, ps2dev - http://www.ps2dev.org
+# Licenced under Academic Free License version 2.0
+# Review ps2sdk README & LICENSE files for further details.
+#
+# In-memory partition index
+*/
+
+#include <errno.h>
+#include <iomanX.h>
+#ifdef _IOP
+#include <sysclib.h>
+#else
+#include <string.h>
+#endif
+#include <stdio.h>
+#include <hdd-ioctl.h>
+
+#include "apa-opt.h"
+#include "libapa.h"
+
+#define APA_INDEX_DEVICES     2
+#define APA_INDEX_MIN_ENTRIES 256
+
+typedef struct
+{
+    apa_index_entry_t *entries;
+    u16 *order;     // Entries, sorted by start LBA.
+    u16 *idBuckets; // Main partitions, by hash of their IDs.
+    u32 count;
+    u32 capacity; // Always a power of 2, also the number of ID buckets.
+    u16 unused;   // Unused entries, linked through idNext.
+    u16 freeHead[APA_INDEX_CLASSES];
+    u32 freeCount[APA_INDEX_CLASSES];
+    u32 freeOdd;      // Free partitions whose sizes are not powers of 2.
+    u32 totalSectors; // Sum of the lengths of all partitions.
+    int valid;
+} apa_index_t;
+
+//  Globals
+static apa_index_t apaIndexes[APA_INDEX_DEVICES];
+
+u32 apaHash(u32 hash, const void *buffer, u32 size)
+{
+    const u8 *p;
+
+    for (p = buffer; size > 0; size--, p++)
+        hash = (hash ^ *p) * 0x01000193;
+
+    return hash;
+}
+
+static u32 apaIndexHashId(const char *id)
+{
+    return apaHash(APA_HASH_INIT, id, APA_IDMAX);
+}
+
+int apaIndexSizeClass(u32 length)
+{
+    int i;
+
+    for (i = 0; length > 1; i++)
+        length >>= 1;
+
+    return i;
+}
+
+static void apaIndexLinkEntry(apa_index_t *index, u16 slot)
+{
+    apa_index_entry_t *entry;
+    u16 *head;
+
+    entry = &index->entries[slot];
+    index->totalSectors += entry->length;
+    if (!(entry->flags & APA_FLAG_SUB)) {
+        head          = &index->idBuckets[entry->idHash & (index->capacity - 1)];
+        entry->idNext = *head;
+        *head         = slot;
+    } else
+        entry->idNext = APA_INDEX_NONE;
+
+    if (entry->type == APA_TYPE_FREE) {
+        head            = &index->freeHead[apaIndexSizeClass(entry->length)];
+        entry->freePrev = APA_INDEX_NONE;
+        entry->freeNext = *head;
+        if (*head != APA_INDEX_NONE)
+            index->entries[*head].freePrev = slot;
+        *head = slot;
+
+        if ((entry->length & (entry->length - 1)) == 0)
+            index->freeCount[apaIndexSizeClass(entry->length)]++;
+        else
+            index->freeOdd++;
+    }
+}
+
+static void apaIndexUnlinkEntry(apa_index_t *index, u16 slot)
+{
+    apa_index_entry_t *entry;
+    u16 *link;
+
+    entry = &index->entries[slot];
+    index->totalSectors -= entry->length;
+    if (!(entry->flags & APA_FLAG_SUB)) {
+        for (link = &index->idBuckets[entry->idHash & (index->capacity - 1)]; *link != slot; link = &index->entries[*link].idNext)
+            ;
+        *link = entry->idNext;
+    }
+
+    if (entry->type == APA_TYPE_FREE) {
+        if (entry->freePrev != APA_INDEX_NONE)
+            index->entries[entry->freePrev].freeNext = entry->freeNext;
+        else
+            index->freeHead[apaIndexSizeClass(entry->length)] = entry->freeNext;
+        if (entry->freeNext != APA_INDEX_NONE)
+            index->entries[entry->freeNext].freePrev = entry->freePrev;
+
+        if ((entry->length & (entry->length - 1)) == 0)
+            index->freeCount[apaIndexSizeClass(entry->length)]--;
+        else
+            index->freeOdd--;
+    }
+}
+
+static void apaIndexSetEntry(apa_index_entry_t *entry, const apa_header_t *header)
+{
+    entry->start  = header->start;
+    entry->length = header->length;
+    entry->type   = header->type;
+    entry->flags  = header->flags;
+    entry->nsub   = header->nsub;
+    entry->idHash = apaIndexHashId(header->id);
+}
+
+// Reallocates the index with room for capacity entries. Entries keep their slot numbers, so only the ID buckets have to be rebuilt.
+static int apaIndexResize(apa_index_t *index, u32 capacity)
+{
+    apa_index_entry_t *entries, *entry;
+    u16 *order, *idBuckets;
+    u32 i;
+
+    if (capacity >= APA_INDEX_NONE)
+        return -ENOMEM;
+
+    entries   = apaAllocMem(capacity * sizeof(apa_index_entry_t));
+    order     = apaAllocMem(capacity * sizeof(u16));
+    idBuckets = apaAllocMem(capacity * sizeof(u16));
+    if (entries == NULL || order == NULL || idBuckets == NULL) {
+        if (entries != NULL)
+            apaFreeMem(entries);
+        if (order != NULL)
+            apaFreeMem(order);
+        if (idBuckets != NULL)
+            apaFreeMem(idBuckets);
+        return -ENOMEM;
+    }
+
+    if (index->entries != NULL) {
+        memcpy(entries, index->entries, index->capacity * sizeof(apa_index_entry_t));
+        memcpy(order, index->order, index->count * sizeof(u16));
+        apaFreeMem(index->entries);
+        apaFreeMem(index->order);
+        apaFreeMem(index->idBuckets);
+    }
+
+    // Entries that are not in use yet are linked to the unused list.
+    for (i = index->capacity; i < capacity; i++)
+        entries[i].idNext = (i + 1 < capacity) ? i + 1 : index->unused;
+    index->unused    = index->capacity;
+    index->entries   = entries;
+    index->order     = order;
+    index->idBuckets = idBuckets;
+    index->capacity  = capacity;
+
+    memset(idBuckets, 0xFF, capacity * sizeof(u16));
+    for (i = 0; i < index->count; i++) {
+        entry = &index->entries[index->order[i]];
+        if (!(entry->flags & APA_FLAG_SUB)) {
+            entry->idNext                             = idBuckets[entry->idHash & (capacity - 1)];
+            idBuckets[entry->idHash & (capacity - 1)] = index->order[i];
+        }
+    }
+
+    return 0;
+}
+
+// Returns the position of the first entry that does not start before start.
+static u32 apaIndexLowerBound(const apa_index_t *index, u32 start)
+{
+    u32 low, high, mid;
+
+    for (low = 0, high = index->count; low < high;) {
+        mid = (low + high) / 2;
+        if (index->entries[index->order[mid]].start < start)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static int apaIndexInsertAt(apa_index_t *index, u32 pos, const apa_header_t *header)
+{
+    u16 slot;
+
+    if (index->unused == APA_INDEX_NONE) {
+        if (apaIndexResize(index, index->capacity * 2) != 0)
+            return -ENOMEM;
+    }
+
+    slot          = index->unused;
+    index->unused = index->entries[slot].idNext;
+    apaIndexSetEntry(&index->entries[slot], header);
+    apaIndexLinkEntry(index, slot);
+
+    memmove(&index->order[pos + 1], &index->order[pos], (index->count - pos) * sizeof(u16));
+    index->order[pos] = slot;
+    index->count++;
+
+    return 0;
+}
+
+static void apaIndexRemoveAt(apa_index_t *index, u32 pos)
+{
+    u16 slot;
+
+    slot = index->order[pos];
+    apaIndexUnlinkEntry(index, slot);
+    index->entries[slot].idNext = index->unused;
+    index->unused               = slot;
+
+    index->count--;
+    memmove(&index->order[pos], &index->order[pos + 1], (index->count - pos) * sizeof(u16));
+}
+
+void apaIndexInvalidate(s32 device)
+{
+    apa_index_t *index;
+
+    if (device >= APA_INDEX_DEVICES)
+        return;
+
+    index = &apaIndexes[device];
+    if (index->entries != NULL) {
+        apaFreeMem(index->entries);
+        apaFreeMem(index->order);
+        apaFreeMem(index->idBuckets);
+    }
+
+    memset(index, 0, sizeof(apa_index_t));
+    index->unused = APA_INDEX_NONE;
+    memset(index->freeHead, 0xFF, sizeof(index->freeHead));
+}
+
+int apaIndexBuild(s32 device)
+{
+    apa_index_t *index;
+    apa_cache_t *clink;
+    int rv;
+
+    if (device >= APA_INDEX_DEVICES)
+        return -ENXIO;
+
+    apaIndexInvalidate(device);
+    index = &apaIndexes[device];
+    if ((rv = apaIndexResize(index, APA_INDEX_MIN_ENTRIES)) != 0)
+        return rv;
+
+    // The chain is sorted by start LBA, so every entry is appended.
+    clink = apaCacheGetHeader(device, APA_SECTOR_MBR, APA_IO_MODE_READ, &rv);
+    while (clink != NULL) {
+        if (index->count > 0 && index->entries[index->order[index->count - 1]].start >= clink->header->start)
+            rv = -EINVAL;
+        else
+            rv = apaIndexInsertAt(index, index->count, clink->header);
+
+        if (rv != 0) {
+            apaCacheFree(clink);
+            break;
+        }
+
+        clink = apaGetNextHeader(clink, &rv);
+    }
+
+    if (rv != 0) {
+        APA_PRINTF(APA_DRV_NAME ": error: could not index device %ld, %d\n", device, rv);
+        apaIndexInvalidate(device);
+        return rv;
+    }
+
+    index->valid = 1;
+
+    return 0;
+}
+
+int apaIndexIsValid(s32 device)
+{
+    return (device < APA_INDEX_DEVICES && apaIndexes[device].valid);
+}
+
+void apaIndexUpdate(s32 device, const apa_header_t *header)
+{
+    apa_index_t *index;
+    u32 pos, end;
+    u16 slot;
+
+    if (!apaIndexIsValid(device))
+        return;
+
+    index = &apaIndexes[device];
+    if (header->magic != APA_MAGIC || (header->next != 0 && header->next <= header->start)) {
+        apaIndexInvalidate(device);
+        return;
+    }
+
+    pos = apaIndexLowerBound(index, header->start);
+    if (pos < index->count && index->entries[index->order[pos]].start == header->start) {
+        slot = index->order[pos];
+        apaIndexUnlinkEntry(index, slot);
+        apaIndexSetEntry(&index->entries[slot], header);
+        apaIndexLinkEntry(index, slot);
+    } else if (apaIndexInsertAt(index, pos, header) != 0) {
+        apaIndexInvalidate(device);
+        return;
+    }
+
+    // Partitions that were merged into this one, or cut off from the end of the chain, are no longer reachable.
+    end = (header->next != 0) ? header->next : 0xFFFFFFFF;
+    while (pos + 1 < index->count && index->entries[index->order[pos + 1]].start < end)
+        apaIndexRemoveAt(index, pos + 1);
+}
+
+u32 apaIndexGetCount(s32 device)
+{
+    return apaIndexIsValid(device) ? apaIndexes[device].count : 0;
+}
+
+const apa_index_entry_t *apaIndexGetEntry(s32 device, u32 pos)
+{
+    return &apaIndexes[device].entries[apaIndexes[device].order[pos]];
+}
+
+const apa_index_entry_t *apaIndexFindStart(s32 device, u32 start)
+{
+    apa_index_t *index;
+    u32 pos;
+
+    index = &apaIndexes[device];
+    pos   = apaIndexLowerBound(index, start);
+    if (pos < index->count && index->entries[index->order[pos]].start == start)
+        return &index->entries[index->order[pos]];
+
+    return NULL;
+}
+
+int apaIndexGetFreeClasses(s32 device, u32 *total, u32 *counts)
+{
+    apa_index_t *index;
+
+    index = &apaIndexes[device];
+    if (index->freeOdd != 0)
+        return -EINVAL;
+
+    *total = index->totalSectors;
+    memcpy(counts, index->freeCount, sizeof(index->freeCount));
+
+    return 0;
+}
+
+const apa_index_entry_t *apaIndexFindFree(s32 device, u32 length)
+{
+    apa_index_t *index;
+    apa_index_entry_t *entry, *result;
+    u16 slot;
+
+    // Like a walk down the chain, return the first suitable partition.
+    index  = &apaIndexes[device];
+    result = NULL;
+    for (slot = index->freeHead[apaIndexSizeClass(length)]; slot != APA_INDEX_NONE; slot = entry->freeNext) {
+        entry = &index->entries[slot];
+        if (entry->length == length && (result == NULL || entry->start < result->start))
+            result = entry;
+    }
+
+    return result;
+}
+
+apa_cache_t *apaIndexFindId(s32 device, const char *id, int *err)
+{
+    apa_index_t *index;
+    apa_index_entry_t *entry;
+    apa_cache_t *clink, *found;
+    u32 hash;
+    u16 slot;
+
+    index = &apaIndexes[device];
+    hash  = apaIndexHashId(id);
+    found = NULL;
+    *err  = 0;
+    for (slot = index->idBuckets[hash & (index->capacity - 1)]; slot != APA_INDEX_NONE; slot = entry->idNext) {
+        entry = &index->entries[slot];
+        if (entry->idHash != hash || (found != NULL && entry->start >= found->header->start))
+            continue;
+
+        if ((clink = apaCacheGetHeader(device, entry->start, APA_IO_MODE_READ, err)) == NULL)
+            break;
+
+        if (memcmp(clink->header->id, id, APA_IDMAX) == 0) {
+            if (found != NULL)
+                apaCacheFree(found);
+            found = clink;
+        } else
+            apaCacheFree(clink);
+    }
+
+    if (*err != 0) {
+        if (found != NULL)
+            apaCacheFree(found);
+        return NULL;
+    }
+
+    if (found == NULL)
+        *err = -ENOENT;
+
+    return found;
+}
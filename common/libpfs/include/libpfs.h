@@ -78,6 +78,8 @@
 #define PFS_GID 0xFFFF
 
 // journal/log
+#define PFS_JOURNAL_MAX_ENTRIES 127 // The log area holds 127 blocks after the 2-sector header.
+
 typedef struct
 {
     u32 magic;    // =PFS_JOUNRNAL_MAGIC
@@ -88,9 +90,13 @@ typedef struct
         u32 sector;    // block/sector for partition
         u16 sub;       // main(0)/sub(+1) partition
         u16 logSector; // block/sector offset in journal area
-    } log[127];
+    } log[PFS_JOURNAL_MAX_ENTRIES];
 } pfs_journal_t;
 
+// Non-SONY: an empty log header may carry the superblock's free_stamp in the sector field of its last entry.
+// Every mount resets the log header, so the stamp only survives until the partition is mounted again.
+#define PFS_JOURNAL_STAMP (PFS_JOURNAL_MAX_ENTRIES - 1)
+
 // Attribute Entry
 typedef struct
 {
@@ -141,6 +147,8 @@ typedef struct
     u32 num_subs;         // number of subs attached to filesystem
     pfs_blockinfo_t log;  // block info for metadata log
     pfs_blockinfo_t root; // block info for root directory
+    u32 free_stamp;       // Non-SONY: the cached free_zone counts are valid while the log header carries this stamp. 0 if none.
+    u32 free_zone[65];    // Non-SONY: free zones in each partition, as of the last clean unmount
 } pfs_super_block_t;
 
 // Inode structure
@@ -178,6 +186,14 @@ typedef struct
     int (*flushCache)(int fd);
 } pfs_block_device_t;
 
+// Non-SONY: the runs of free zones in a bitmap chunk, for the free-extent index. See pfsBitmapIndexFind().
+typedef struct
+{
+    u16 longest;  // longest run in the chunk
+    u16 leading;  // free zones at the start of the chunk
+    u16 trailing; // free zones at the end of the chunk
+} pfs_free_run_t;
+
 typedef struct
 {
     pfs_block_device_t *blockDev; // call table for hdd(hddCallTable)
@@ -194,6 +210,7 @@ typedef struct
     pfs_blockinfo_t current_dir;  // block info for current directory
     u32 lastError;                // 0 if no error :)
     u32 free_zone[65];            // free zones in each partition (1 main + 64 possible subs)
+    pfs_free_run_t *free_run[65]; // Non-SONY: runs of free zones in each bitmap chunk, per partition. See pfsBitmapIndexFind().
 } pfs_mount_t;
 
 typedef struct pfs_cache_s
@@ -214,6 +231,9 @@ typedef struct pfs_cache_s
         pfs_super_block_t *superblock;
         u32 *bitmap;
     } u;
+    struct pfs_cache_s *hnext; // Non-SONY: next buffer in the same hash chain.
+    struct pfs_cache_s *dnext; // Non-SONY: dirty list, of the buffers that are dirty or held.
+    struct pfs_cache_s *dprev; //
 } pfs_cache_t;
 
 typedef struct
@@ -237,10 +257,14 @@ int pfsFormatSub(pfs_block_device_t *blockDev, int fd, u32 sub, u32 reserved, u3
 int pfsFormat(pfs_block_device_t *blockDev, int fd, int zonesize, int fragment);
 int pfsUpdateSuperBlock(pfs_mount_t *pfsMount, pfs_super_block_t *superblock, u32 sub);
 int pfsMountSuperBlock(pfs_mount_t *pfsMount);
+int pfsSaveFreeZones(pfs_mount_t *pfsMount);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Cache functions
 
+#define PFS_CACHE_MAX_BUFFERS   4096 // Non-SONY: was 127, when the whole cache was written to the journal.
+#define PFS_CACHE_GATHER_BLOCKS 32   // Non-SONY: size of the buffer that blocks are gathered in, to be written with one transfer.
+
 void pfsCacheFree(pfs_cache_t *clink);
 void pfsCacheLink(pfs_cache_t *clink, pfs_cache_t *cnew);
 pfs_cache_t *pfsCacheUnLink(pfs_cache_t *clink);
@@ -271,12 +295,16 @@ typedef struct
 } pfs_bitmapInfo_t;
 
 void pfsBitmapSetupInfo(pfs_mount_t *pfsMount, pfs_bitmapInfo_t *info, u32 subpart, u32 number);
+u32 pfsBitmapLowestBit(u32 word);
+u32 pfsBitmapMask(u32 bit, u32 count);
+void pfsBitmapIndexReset(pfs_mount_t *pfsMount);
 void pfsBitmapAllocFree(pfs_cache_t *clink, u32 operation, u32 subpart, u32 chunk, u32 index, u32 _bit, u32 count);
 int pfsBitmapAllocateAdditionalZones(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 count);
 int pfsBitmapAllocZones(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 amount);
 int pfsBitmapSearchFreeZone(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_count);
 void pfsBitmapFreeBlockSegment(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi);
 int pfsBitmapCalcFreeZones(pfs_mount_t *pfsMount, int sub);
+u32 pfsBitmapCountFree(const void *bitmap, u32 size);
 void pfsBitmapShow(pfs_mount_t *pfsMount);
 void pfsBitmapFreeInodeBlocks(pfs_cache_t *clink);
 
@@ -286,6 +314,8 @@ void pfsBitmapFreeInodeBlocks(pfs_cache_t *clink);
 int pfsBlockSeekNextSegment(pfs_cache_t *clink, pfs_blockpos_t *blockpos);
 u32 pfsBlockSyncPos(pfs_blockpos_t *blockpos, u64 size);
 int pfsBlockInitPos(pfs_cache_t *clink, pfs_blockpos_t *blockpos, u64 position);
+void pfsBlockForgetExtents(void);
+void pfsBlockResetExtents(void);
 int pfsBlockExpandSegment(pfs_cache_t *clink, pfs_blockpos_t *blockpos, u32 count);
 int pfsBlockAllocNewSegment(pfs_cache_t *clink, pfs_blockpos_t *blockpos, u32 blocks);
 pfs_blockinfo_t *pfsBlockGetCurrent(pfs_blockpos_t *blockpos);
@@ -312,6 +342,7 @@ pfs_cache_t *pfsInodeCreate(pfs_cache_t *clink, u16 mode, u16 uid, u16 gid, int
 int pfsCheckAccess(pfs_cache_t *clink, int flags);
 char *pfsSplitPath(char *filename, char *path, int *result);
 u16 pfsGetMaxIndex(pfs_mount_t *pfsMount);
+void pfsDirIndexReset(void);
 
 int pfsAllocZones(pfs_cache_t *clink, int msize, int mode);
 void pfsFreeZones(pfs_cache_t *pfree);
@@ -332,11 +363,13 @@ pfs_cache_t *pfsGetDentriesAtPos(pfs_cache_t *clink, u64 position, int *offset,
 //    Journal functions
 
 int pfsJournalChecksum(void *header);
-void pfsJournalWrite(pfs_mount_t *pfsMount, pfs_cache_t *clink, u32 pfsCacheNumBuffers);
+void pfsJournalWrite(pfs_mount_t *pfsMount, pfs_cache_t **clink, u32 count);
 int pfsJournalReset(pfs_mount_t *pfsMount);
 int pfsJournalFlush(pfs_mount_t *pfsMount);
 int pfsJournalRestore(pfs_mount_t *pfsMount);
 int pfsJournalResetThis(pfs_block_device_t *blockDev, int fd, u32 sector);
+u32 pfsJournalGetStamp(pfs_mount_t *pfsMount);
+int pfsJournalWriteStamp(pfs_mount_t *pfsMount, u32 stamp);
 
 ///////////////////////////////////////////////////////////////////////////////
 //    Function declerations
@@ -13,6 +13,11 @@
 #include <errno.h>
 #include <stdio.h>
 #include <limits.h>
+#ifdef _IOP
+#include <sysclib.h>
+#else
+#include <string.h>
+#endif
 
 #include "pfs-opt.h"
 #include "libpfs.h"
@@ -35,33 +40,172 @@ void pfsBitmapSetupInfo(pfs_mount_t *pfsMount, pfs_bitmapInfo_t *info, u32 subpa
     info->partitionRemainder = size % pfsBitsPerBitmapChunk;
 }
 
+// Non-SONY: returns the index of the lowest set bit of a non-zero word. The IOP has no instruction for this.
+u32 pfsBitmapLowestBit(u32 word)
+{
+    static const u8 DeBruijnBits[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9};
+
+    return DeBruijnBits[((word & -word) * 0x077CB531) >> 27];
+}
+
+// Non-SONY: returns a mask of count bits from bit upwards.
+u32 pfsBitmapMask(u32 bit, u32 count)
+{
+    return (count >= 32 - bit ? 0xFFFFFFFF : ((u32)1 << count) - 1) << bit;
+}
+
+// Non-SONY: the free-extent index keeps the longest run of free zones within each bitmap chunk of a partition,
+// and the free zones at either end of the chunk, so that runs that cross chunks are not missed.
+// Entries are read from the chunks when first needed, and are read again after their chunk changes.
+// The search then skips chunks that cannot hold a run, without reading them.
+#define PFS_BITMAP_RUN_UNKNOWN 0xFFFF
+
+void pfsBitmapIndexReset(pfs_mount_t *pfsMount)
+{
+    u32 i;
+
+    for (i = 0; i < sizeof(pfsMount->free_run) / sizeof(pfsMount->free_run[0]); i++) {
+        if (pfsMount->free_run[i] != NULL) {
+            pfsFreeMem(pfsMount->free_run[i]);
+            pfsMount->free_run[i] = NULL;
+        }
+    }
+}
+
+// Non-SONY: called for every change to a bitmap chunk. Zones were allocated or freed, so the segments of an inode may have changed too.
+static void pfsBitmapChunkChanged(pfs_mount_t *pfsMount, u32 subpart, u32 chunk)
+{
+    if (pfsMount->free_run[subpart] != NULL)
+        pfsMount->free_run[subpart][chunk].longest = PFS_BITMAP_RUN_UNKNOWN;
+    pfsBlockForgetExtents();
+}
+
+static void pfsBitmapFindRuns(const u32 *bitmapWord, const u32 *bitmapEnd, pfs_free_run_t *runs)
+{
+    u32 i, n, free, run, longest, leading;
+
+    for (run = 0, longest = 0, leading = 0xFFFFFFFF; bitmapWord < bitmapEnd; bitmapWord++) {
+        if ((free = ~*bitmapWord) == 0xFFFFFFFF) {
+            run += 32;
+        } else {
+            for (i = 0; i < 32; i += n) {
+                if (((free >> i) & 1) == 0) {
+                    if (leading == 0xFFFFFFFF)
+                        leading = run;
+                    if (run > longest)
+                        longest = run;
+                    run = 0;
+                    if ((free >> i) == 0)
+                        break;
+                    i += pfsBitmapLowestBit(free >> i);
+                }
+
+                n = (~free >> i) ? pfsBitmapLowestBit(~free >> i) : 32 - i;
+                run += n;
+            }
+        }
+    }
+
+    runs->longest  = run > longest ? run : longest;
+    runs->leading  = leading == 0xFFFFFFFF ? run : leading;
+    runs->trailing = run;
+}
+
+// Moves the position in bi forward to the first chunk that may hold a run of at least amount free zones. Returns 0 if there is none.
+// The run may start in an earlier chunk, if it continues into this one. The position is then moved to the chunk where it starts.
+static int pfsBitmapIndexFind(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 amount)
+{
+    pfs_bitmapInfo_t info;
+    pfs_cache_t *clink;
+    u32 chunks, sector, bitmapMax, carry, carryChunk;
+    pfs_free_run_t *runs;
+    int result;
+
+    pfsBitmapSetupInfo(pfsMount, &info, bi->subpart, bi->number);
+    chunks = info.partitionChunks + (info.partitionRemainder != 0);
+
+    if ((runs = pfsMount->free_run[bi->subpart]) == NULL) {
+        // Without memory for the index, every chunk is searched.
+        if ((runs = pfsAllocMem(chunks * sizeof(pfs_free_run_t))) == NULL)
+            return 1;
+        memset(runs, 0xFF, chunks * sizeof(pfs_free_run_t));
+        pfsMount->free_run[bi->subpart] = runs;
+    }
+
+    // carry is the run of free zones that ends at the end of the previous chunk, and starts in carryChunk.
+    for (carry = 0, carryChunk = info.chunk; info.chunk < chunks; info.chunk++) {
+        bitmapMax = info.chunk == info.partitionChunks ? info.partitionRemainder / 8 : pfsMetaSize;
+
+        if (runs[info.chunk].longest == PFS_BITMAP_RUN_UNKNOWN) {
+            sector = info.chunk + (1 << pfsMount->inode_scale);
+            if (bi->subpart == 0)
+                sector += 0x2000 >> pfsBlockSize;
+
+            if ((clink = pfsCacheGetData(pfsMount, bi->subpart, sector, PFS_CACHE_FLAG_BITMAP, &result)) == NULL)
+                return 0;
+
+            pfsBitmapFindRuns(clink->u.bitmap, (u32 *)&((u8 *)clink->u.bitmap)[bitmapMax], &runs[info.chunk]);
+            pfsCacheFree(clink);
+        }
+
+        // A run that starts in an earlier chunk comes before any run within this one.
+        if (carry != 0 && carry + runs[info.chunk].leading >= amount) {
+            if (carryChunk * pfsBitsPerBitmapChunk > bi->number)
+                bi->number = carryChunk * pfsBitsPerBitmapChunk;
+            return 1;
+        }
+
+        if (runs[info.chunk].longest >= amount) {
+            if (info.chunk * pfsBitsPerBitmapChunk > bi->number)
+                bi->number = info.chunk * pfsBitsPerBitmapChunk;
+            return 1;
+        }
+
+        if (runs[info.chunk].leading >= bitmapMax * 8) {
+            if (carry == 0)
+                carryChunk = info.chunk;
+            carry += runs[info.chunk].leading;
+        } else {
+            carry      = runs[info.chunk].trailing;
+            carryChunk = info.chunk;
+        }
+    }
+
+    return 0;
+}
+
 // Allocates or frees (depending on operation) the bitmap area starting at chunk/index/bit, of size count
 void pfsBitmapAllocFree(pfs_cache_t *clink, u32 operation, u32 subpart, u32 chunk, u32 index, u32 _bit, u32 count)
 {
     int result;
-    u32 sector, bit;
+    u32 sector, n, mask;
     u32 *bitmapWord, *bitmapEnd;
 
     while (clink) {
         bitmapEnd = (u32 *)&((u8 *)clink->u.bitmap)[pfsMetaSize];
+        // Non-SONY: a word at a time.
         for (bitmapWord = &clink->u.bitmap[index]; (bitmapWord < bitmapEnd) && count; bitmapWord++, _bit = 0) {
-            for (bit = _bit; bit < 32 && count; bit++, count--) {
-                if (operation == PFS_BITMAP_ALLOC) {
-                    if (*bitmapWord & (1 << bit))
-                        PFS_PRINTF(PFS_DRV_NAME ": Error: Tried to allocate used block!\n");
-
-                    *bitmapWord |= (1 << bit);
-                } else {
-                    if ((*bitmapWord & (1 << bit)) == 0)
-                        PFS_PRINTF(PFS_DRV_NAME ": Error: Tried to free unused block!\n");
-
-                    *bitmapWord &= ~(1 << bit);
-                }
+            n    = (count < 32 - _bit) ? count : 32 - _bit;
+            mask = pfsBitmapMask(_bit, n);
+            if (operation == PFS_BITMAP_ALLOC) {
+                if (*bitmapWord & mask)
+                    PFS_PRINTF(PFS_DRV_NAME ": Error: Tried to allocate used block!\n");
+
+                *bitmapWord |= mask;
+            } else {
+                if ((*bitmapWord & mask) != mask)
+                    PFS_PRINTF(PFS_DRV_NAME ": Error: Tried to free unused block!\n");
+
+                *bitmapWord &= ~mask;
             }
+            count -= n;
         }
 
         index = 0;
         clink->flags |= PFS_CACHE_FLAG_DIRTY;
+        pfsBitmapChunkChanged(clink->pfsMount, subpart, chunk);
         pfsCacheFree(clink);
 
         if (count == 0)
@@ -84,7 +228,7 @@ int pfsBitmapAllocateAdditionalZones(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi,
     pfs_bitmapInfo_t info;
     pfs_cache_t *c;
     int res = 0;
-    u32 bitmapMax;
+    u32 bitmapMax, used, n;
     u32 *bitmapWord, *bitmapEnd;
 
     pfsBitmapSetupInfo(pfsMount, &info, bi->subpart, bi->number + bi->count);
@@ -114,25 +258,30 @@ int pfsBitmapAllocateAdditionalZones(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi,
         bitmapMax = info.chunk == info.partitionChunks ? info.partitionRemainder / 8 : pfsMetaSize;
         bitmapEnd = (u32 *)&((u8 *)c->u.bitmap)[bitmapMax];
         for (bitmapWord = &c->u.bitmap[info.index]; (bitmapWord < bitmapEnd) && count; bitmapWord++, info.bit = 0) {
-            // Loop over each of the 32 bits in the current word from the current bitmap chunk,
-            // trying to allocate the requested number of zones
-            for (; (info.bit < 32) && count; count--) {
-                // We only want to allocate a continuous area, so if we come
-                // accross a used zone bail
-                if (*bitmapWord & (1 << info.bit)) {
-                    pfsCacheFree(c);
-                    goto exit;
-                }
-
-                // If the current bit in the bitmap is marked as free, mark it was used
-                res++;
-                *bitmapWord |= 1 << info.bit;
-                info.bit++;
+            // Non-SONY: take the free zones up to the first used one in the word at once.
+            used = *bitmapWord >> info.bit;
+            n    = used ? pfsBitmapLowestBit(used) : 32 - info.bit;
+            if (n > count)
+                n = count;
+
+            if (n != 0) {
+                *bitmapWord |= pfsBitmapMask(info.bit, n);
+                res += n;
+                count -= n;
                 c->flags |= PFS_CACHE_FLAG_DIRTY;
+                pfsBitmapChunkChanged(pfsMount, bi->subpart, info.chunk);
+            }
+
+            // We only want to allocate a continuous area, so if we come
+            // accross a used zone bail
+            if (count && info.bit + n < 32) {
+                pfsCacheFree(c);
+                goto exit;
             }
         }
         pfsCacheFree(c);
         info.index = 0;
+        info.bit   = 0;
         info.chunk++;
     }
 exit:
@@ -153,7 +302,7 @@ int pfsBitmapAllocZones(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 amount)
     u32 sector;
     pfs_cache_t *bitmap;
     u32 *bitmapWord, *bitmapEnd;
-    u32 i, bitmapMax;
+    u32 i, n, free, bitmapMax;
 
     pfsBitmapSetupInfo(pfsMount, &info, bi->subpart, bi->number);
 
@@ -173,47 +322,60 @@ int pfsBitmapAllocZones(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 amount)
         bitmapMax = info.chunk == info.partitionChunks ? info.partitionRemainder / 8 : pfsMetaSize;
         bitmapEnd = (u32 *)&((u8 *)bitmap->u.bitmap)[bitmapMax];
         for (bitmapWord = &bitmap->u.bitmap[info.index]; bitmapWord < bitmapEnd; info.bit = 0, bitmapWord++) {
-            for (i = info.bit; i < 32; i++) {
-                // if this bit is marked as free..
-                if (((*bitmapWord >> i) & 1) == 0) {
-                    if (count == 0) {
-                        startBit   = i;
-                        startChunk = info.chunk;
-                        startPos   = bitmapWord - bitmap->u.bitmap;
-                    }
-                    if (++count == amount) {
-                        bi->number = (startPos * 32) + (startChunk * pfsBitsPerBitmapChunk) + startBit;
-                        if (count < bi->count)
-                            bi->count = count;
-
-                        if (bitmap->block != (startChunk + (1 << pfsMount->inode_scale))) {
-                            pfsCacheFree(bitmap);
-                            sector = (1 << pfsMount->inode_scale) + startChunk;
-                            if (bi->subpart == 0)
-                                sector += 0x2000 >> pfsBlockSize;
-
-                            bitmap = pfsCacheGetData(pfsMount, bi->subpart, sector, PFS_CACHE_FLAG_BITMAP, &result);
-                        }
-
-                        pfsBitmapAllocFree(bitmap, PFS_BITMAP_ALLOC, bi->subpart, startChunk, startPos, startBit, bi->count);
-                        return 1;
-                    }
-                } else
+            // Non-SONY: runs of free zones are found a word at a time. The bits before the start are treated as used.
+            free = ~*bitmapWord & pfsBitmapMask(info.bit, 32);
+            if (free == 0) {
+                count = 0;
+                continue;
+            }
+
+            for (i = 0; i < 32;) {
+                // Skip to the next free zone.
+                if (((free >> i) & 1) == 0) {
                     count = 0;
+                    if ((free >> i) == 0)
+                        break;
+                    i += pfsBitmapLowestBit(free >> i);
+                }
+
+                if (count == 0) {
+                    startBit   = i;
+                    startChunk = info.chunk;
+                    startPos   = bitmapWord - bitmap->u.bitmap;
+                }
+
+                // The length of this run of free zones within the word.
+                n = (~free >> i) ? pfsBitmapLowestBit(~free >> i) : 32 - i;
+                if ((count += n) >= amount) {
+                    bi->number = (startPos * 32) + (startChunk * pfsBitsPerBitmapChunk) + startBit;
+                    if (amount < bi->count)
+                        bi->count = amount;
+
+                    if (bitmap->block != (startChunk + (1 << pfsMount->inode_scale))) {
+                        pfsCacheFree(bitmap);
+                        sector = (1 << pfsMount->inode_scale) + startChunk;
+                        if (bi->subpart == 0)
+                            sector += 0x2000 >> pfsBlockSize;
+
+                        bitmap = pfsCacheGetData(pfsMount, bi->subpart, sector, PFS_CACHE_FLAG_BITMAP, &result);
+                    }
+
+                    pfsBitmapAllocFree(bitmap, PFS_BITMAP_ALLOC, bi->subpart, startChunk, startPos, startBit, bi->count);
+                    return 1;
+                }
+                i += n;
             }
         }
         pfsCacheFree(bitmap);
         info.index = 0;
+        info.bit   = 0;
     }
     return 0;
 }
 
-// Searches for 'max_count' free zones over all the partitions, and
-// allocates them. Returns 0 on success, -ENOSPC if the zones could
-// not be allocated.
-int pfsBitmapSearchFreeZone(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_count)
+static int pfsBitmapSearch(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_count, int indexed)
 {
-    u32 num, count, n;
+    u32 num, count, n, number;
 
     num = pfsMount->num_subs + 1;
 
@@ -226,14 +388,17 @@ int pfsBitmapSearchFreeZone(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_
     if (count < bi->count)
         count = bi->count; // max(count, bi->count)
                            //  => count = bound(bi->count, 32);
-    for (--num; num >= 0; num--) {
+    for (; num != 0; num--) {
         for (n = count; n; n /= 2) {
+            number = bi->number;
             if ((pfsMount->free_zone[bi->subpart] >= n) &&
+                (!indexed || pfsBitmapIndexFind(pfsMount, bi, n)) &&
                 pfsBitmapAllocZones(pfsMount, bi, n)) {
                 pfsMount->free_zone[bi->subpart] -= bi->count;
                 pfsMount->zfree -= bi->count;
                 return 0; // the good exit ;)
             }
+            bi->number = number;
         }
 
         bi->number = 0;
@@ -245,6 +410,22 @@ int pfsBitmapSearchFreeZone(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_
     return -ENOSPC;
 }
 
+// Searches for 'max_count' free zones over all the partitions, and
+// allocates them. Returns 0 on success, -ENOSPC if the zones could
+// not be allocated.
+int pfsBitmapSearchFreeZone(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_count)
+{
+    pfs_blockinfo_t hint;
+
+    // Non-SONY: the index only misses chunks that were changed without it. Those are found by a full search.
+    memcpy(&hint, bi, sizeof(pfs_blockinfo_t));
+    if (pfsBitmapSearch(pfsMount, bi, max_count, 1) == 0)
+        return 0;
+
+    memcpy(bi, &hint, sizeof(pfs_blockinfo_t));
+    return pfsBitmapSearch(pfsMount, bi, max_count, 0);
+}
+
 // De-allocates the block segment 'bi' in the bitmaps
 void pfsBitmapFreeBlockSegment(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi)
 {
@@ -266,15 +447,36 @@ void pfsBitmapFreeBlockSegment(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi)
     }
 }
 
+// Non-SONY: returns the number of free zones in the first size bytes of a bitmap, counting the used bits of a word at a time.
+u32 pfsBitmapCountFree(const void *bitmap, u32 size)
+{
+    const u32 *bitmapWord;
+    u32 i, word, used;
+
+    for (i = 0, used = 0, bitmapWord = bitmap; i < size / 4; i++) {
+        if ((word = bitmapWord[i]) != 0) {
+            word = word - ((word >> 1) & 0x55555555);
+            word = (word & 0x33333333) + ((word >> 2) & 0x33333333);
+            word = (word + (word >> 4)) & 0x0F0F0F0F;
+            used += (word * 0x01010101) >> 24;
+        }
+    }
+
+    for (i *= 4; i < size; i++) {
+        for (word = ((const u8 *)bitmap)[i]; word != 0; word &= word - 1)
+            used++;
+    }
+
+    return size * 8 - used;
+}
+
 // Returns the number of free zones for the partition 'sub'
 int pfsBitmapCalcFreeZones(pfs_mount_t *pfsMount, int sub)
 {
-    // "Free zone" map. Used to get number of free zone in bitmap, 4-bits at a time
-    u32 pfsFreeZoneBitmap[16] = {4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0};
     int result;
     pfs_bitmapInfo_t info;
     pfs_cache_t *clink;
-    u32 i, bitmapSize, zoneFree = 0, sector;
+    u32 bitmapSize, zoneFree = 0, sector;
 
     pfsBitmapSetupInfo(pfsMount, &info, sub, 0);
 
@@ -287,10 +489,7 @@ int pfsBitmapCalcFreeZones(pfs_mount_t *pfsMount, int sub)
             sector += 0x2000 >> pfsBlockSize;
 
         if ((clink = pfsCacheGetData(pfsMount, sub, sector, PFS_CACHE_FLAG_BITMAP, &result))) {
-            for (i = 0; i < bitmapSize; i++) {
-                zoneFree += pfsFreeZoneBitmap[((u8 *)clink->u.bitmap)[i] & 0xF] + pfsFreeZoneBitmap[((u8 *)clink->u.bitmap)[i] >> 4];
-            }
-
+            zoneFree += pfsBitmapCountFree(clink->u.bitmap, bitmapSize);
             pfsCacheFree(clink);
         }
         info.chunk++;
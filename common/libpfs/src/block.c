@@ -79,14 +79,164 @@ u32 pfsBlockSyncPos(pfs_blockpos_t *blockpos, u64 size)
     return i;
 }
 
+// Non-SONY: extent maps of the inodes that have indirect segment descriptors, so that a seek does not follow the whole chain.
+// A map lists the zone offset at which each data segment starts, and where each segment descriptor is.
+// Maps are dropped whenever zones are allocated or freed, as the segments of any inode may have changed then.
+#define PFS_BLOCK_EXTENT_MAPS         4
+#define PFS_BLOCK_EXTENT_MAX_SEGMENTS 4096 // Larger maps would take too much of the IOP's memory.
+
+typedef struct
+{
+    pfs_mount_t *pfsMount;
+    u32 sub;                     // location of the inode
+    u32 block;                   //
+    u32 number_data;             // number of segments when the map was built
+    u32 generation;              // valid while equal to pfsBlockExtentGeneration
+    u32 count;                   // number of data segments
+    u32 total;                   // number of data zones
+    u32 capacity;                // number_data that the buffer can hold
+    u32 *start;                  // zone offset at which each data segment starts
+    u32 *segment;                // index of each data segment
+    pfs_blockinfo_t *descriptor; // segment descriptors, of which the inode is the first
+} pfs_block_extents_t;
+
+static pfs_block_extents_t pfsBlockExtents[PFS_BLOCK_EXTENT_MAPS];
+static u32 pfsBlockExtentNext;
+static u32 pfsBlockExtentGeneration = 1;
+
+void pfsBlockForgetExtents(void)
+{
+    pfsBlockExtentGeneration++;
+}
+
+void pfsBlockResetExtents(void)
+{
+    u32 i;
+
+    for (i = 0; i < PFS_BLOCK_EXTENT_MAPS; i++) {
+        if (pfsBlockExtents[i].start != NULL)
+            pfsFreeMem(pfsBlockExtents[i].start);
+        memset(&pfsBlockExtents[i], 0, sizeof(pfs_block_extents_t));
+    }
+
+    pfsBlockExtentGeneration++;
+}
+
+static pfs_block_extents_t *pfsBlockGetExtents(pfs_cache_t *clink)
+{
+    pfs_block_extents_t *map;
+    pfs_cache_t *segment;
+    u32 i, number_data;
+    int result;
+
+    if ((number_data = clink->u.inode->number_data) > PFS_BLOCK_EXTENT_MAX_SEGMENTS)
+        return NULL;
+
+    for (i = 0; i < PFS_BLOCK_EXTENT_MAPS; i++) {
+        map = &pfsBlockExtents[i];
+        if (map->generation == pfsBlockExtentGeneration && map->pfsMount == clink->pfsMount &&
+            map->sub == clink->sub && map->block == clink->block && map->number_data == number_data)
+            return map;
+    }
+
+    map                = &pfsBlockExtents[pfsBlockExtentNext];
+    pfsBlockExtentNext = (pfsBlockExtentNext + 1) % PFS_BLOCK_EXTENT_MAPS;
+    map->generation    = 0;
+
+    if (map->capacity < number_data) {
+        if (map->start != NULL)
+            pfsFreeMem(map->start);
+        // One buffer holds the offsets, the indices and the descriptors.
+        if ((map->start = pfsAllocMem(number_data * (2 * sizeof(u32) + sizeof(pfs_blockinfo_t)))) == NULL) {
+            map->capacity = 0;
+            return NULL;
+        }
+        map->capacity   = number_data;
+        map->segment    = &map->start[number_data];
+        map->descriptor = (pfs_blockinfo_t *)&map->segment[number_data];
+    }
+
+    memcpy(&map->descriptor[0], &clink->u.inode->inode_block, sizeof(pfs_blockinfo_t));
+    segment = pfsCacheUsedAdd(clink);
+    for (i = 1, map->count = 0, map->total = 0; i < number_data; i++) {
+        if (pfsFixIndex(i) == 0) {
+            if ((segment = pfsBlockGetNextSegment(segment, &result)) == NULL)
+                return NULL;
+            memcpy(&map->descriptor[(i - PFS_INODE_MAX_BLOCKS) / 123 + 1], &segment->u.inode->data[0], sizeof(pfs_blockinfo_t));
+            continue;
+        }
+
+        map->start[map->count]   = map->total;
+        map->segment[map->count] = i;
+        map->count++;
+        map->total += segment->u.inode->data[pfsFixIndex(i)].count;
+    }
+    pfsCacheFree(segment);
+
+    map->pfsMount    = clink->pfsMount;
+    map->sub         = clink->sub;
+    map->block       = clink->block;
+    map->number_data = number_data;
+    map->generation  = pfsBlockExtentGeneration;
+
+    return map;
+}
+
+// Non-SONY: positions blockpos like pfsInodeSync() would from the start of the file, by a binary search of the extent map.
+static int pfsBlockSeekExtents(pfs_block_extents_t *map, pfs_blockpos_t *blockpos, u64 position)
+{
+    pfs_mount_t *pfsMount = blockpos->inode->pfsMount;
+    pfs_blockinfo_t *descriptor;
+    pfs_cache_t *clink;
+    u32 zone, low, high, middle;
+    int result;
+
+    zone                  = (u32)(position / pfsMount->zsize);
+    blockpos->byte_offset = position % pfsMount->zsize;
+
+    if (map->count == 0 || zone > map->total || (zone == map->total && blockpos->byte_offset)) {
+        PFS_PRINTF(PFS_DRV_NAME ": panic: fp exceeds file.\n");
+        return -EINVAL;
+    }
+
+    // The last segment that starts at or before the zone. Empty segments are passed over, like pfsInodeSync() does.
+    for (low = 0, high = map->count - 1; low < high;) {
+        middle = (low + high + 1) / 2;
+        if (map->start[middle] <= zone)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    blockpos->block_segment = map->segment[low];
+    blockpos->block_offset  = zone - map->start[low];
+
+    if (blockpos->block_segment >= PFS_INODE_MAX_BLOCKS) {
+        descriptor = &map->descriptor[(blockpos->block_segment - PFS_INODE_MAX_BLOCKS) / 123 + 1];
+        if ((clink = pfsCacheGetData(pfsMount, descriptor->subpart, descriptor->number << pfsMount->inode_scale, PFS_CACHE_FLAG_SEGI, &result)) == NULL)
+            return result;
+
+        pfsCacheFree(blockpos->inode);
+        blockpos->inode = clink;
+    }
+
+    return 0;
+}
+
 int pfsBlockInitPos(pfs_cache_t *clink, pfs_blockpos_t *blockpos, u64 position)
 {
+    pfs_block_extents_t *map;
+
     blockpos->inode       = pfsCacheUsedAdd(clink);
     blockpos->byte_offset = 0;
 
     if (clink->u.inode->size) {
         blockpos->block_segment = 1;
         blockpos->block_offset  = 0;
+
+        // Non-SONY: only a chain of segment descriptors is worth mapping.
+        if (clink->u.inode->number_data > PFS_INODE_MAX_BLOCKS && (map = pfsBlockGetExtents(clink)) != NULL)
+            return pfsBlockSeekExtents(map, blockpos, position);
     } else {
         blockpos->block_segment = 0;
         blockpos->block_offset  = 1;
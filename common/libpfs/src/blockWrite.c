@@ -37,6 +37,7 @@ int pfsBlockExpandSegment(pfs_cache_t *clink, pfs_blockpos_t *blockpos, u32 coun
         clink->u.inode->number_blocks += ret;
         blockpos->inode->flags |= PFS_CACHE_FLAG_DIRTY;
         clink->flags |= PFS_CACHE_FLAG_DIRTY;
+        pfsBlockForgetExtents(); // Non-SONY: the segment has grown.
     }
 
     return ret;
@@ -117,6 +118,7 @@ int pfsBlockAllocNewSegment(pfs_cache_t *clink, pfs_blockpos_t *blockpos, u32 bl
     memcpy(&blockpos->inode->u.inode->data[i], &bi, sizeof(pfs_blockinfo_t));
 
     blockpos->inode->flags |= PFS_CACHE_FLAG_DIRTY;
+    pfsBlockForgetExtents(); // Non-SONY: a segment was added.
     blocks -= bi.count;
     if (blocks)
         blocks -= pfsBlockExpandSegment(clink, blockpos, blocks);
@@ -27,6 +27,107 @@ extern u32 pfsBlockSize;
 pfs_cache_t *pfsCacheBuf;
 u32 pfsCacheNumBuffers;
 
+// Non-SONY: buffers are looked up through a hash of (sub, block), instead of by checking every buffer.
+static pfs_cache_t **pfsCacheHash;
+static u32 pfsCacheHashMask;
+
+// Non-SONY: the dirty list holds every buffer that is dirty or held, since only a holder can make a buffer dirty.
+// It is kept within what one journal commit can hold, so flushing does not have to look at every buffer.
+static pfs_cache_t pfsCacheDirty;
+static u32 pfsCacheNumDirty;
+static pfs_cache_t *pfsCacheCommit[PFS_JOURNAL_MAX_ENTRIES];
+
+#define PFS_CACHE_WRITEBACK_GROUP 8 // Buffers written back together when a dirty buffer is reused.
+
+// Non-SONY: dirty buffers of neighbouring blocks, and the blocks of a journal commit, are written together from here.
+u8 *pfsCacheGather;
+
+static pfs_cache_t **pfsCacheHashHead(u32 sub, u32 block)
+{
+    return &pfsCacheHash[(block ^ (block >> 10) ^ (sub << 6)) & pfsCacheHashMask];
+}
+
+static void pfsCacheHashAdd(pfs_cache_t *clink)
+{
+    pfs_cache_t **head;
+
+    head         = pfsCacheHashHead(clink->sub, clink->block);
+    clink->hnext = *head;
+    *head        = clink;
+}
+
+static void pfsCacheHashRemove(pfs_cache_t *clink)
+{
+    pfs_cache_t **pclink;
+
+    for (pclink = pfsCacheHashHead(clink->sub, clink->block); *pclink != NULL; pclink = &(*pclink)->hnext) {
+        if (*pclink == clink) {
+            *pclink = clink->hnext;
+            break;
+        }
+    }
+    clink->hnext = NULL;
+}
+
+static void pfsCacheDirtyRemove(pfs_cache_t *clink)
+{
+    if (clink->dnext != NULL) {
+        clink->dprev->dnext = clink->dnext;
+        clink->dnext->dprev = clink->dprev;
+        clink->dnext        = NULL;
+        clink->dprev        = NULL;
+        pfsCacheNumDirty--;
+    }
+}
+
+// Drops the buffers that are neither dirty nor held.
+static void pfsCacheDirtyTrim(void)
+{
+    pfs_cache_t *clink, *next;
+
+    for (clink = pfsCacheDirty.dnext; clink != &pfsCacheDirty; clink = next) {
+        next = clink->dnext;
+        if (clink->nused == 0 && !(clink->flags & PFS_CACHE_FLAG_DIRTY))
+            pfsCacheDirtyRemove(clink);
+    }
+}
+
+static void pfsCacheDirtyAdd(pfs_cache_t *clink)
+{
+    pfs_cache_t *dirty;
+
+    if (clink->dnext != NULL)
+        return;
+
+    // A full list is flushed, so that all of its dirty buffers always fit in the journal.
+    if (pfsCacheNumDirty >= PFS_JOURNAL_MAX_ENTRIES) {
+        pfsCacheDirtyTrim();
+        while (pfsCacheNumDirty >= PFS_JOURNAL_MAX_ENTRIES) {
+            for (dirty = pfsCacheDirty.dnext; dirty != &pfsCacheDirty && !(dirty->flags & PFS_CACHE_FLAG_DIRTY); dirty = dirty->dnext)
+                ;
+            if (dirty == &pfsCacheDirty)
+                break; // All are held.
+            pfsCacheFlushAllDirty(dirty->pfsMount);
+        }
+    }
+
+    clink->dprev               = pfsCacheDirty.dprev;
+    clink->dnext               = &pfsCacheDirty;
+    pfsCacheDirty.dprev->dnext = clink;
+    pfsCacheDirty.dprev        = clink;
+    pfsCacheNumDirty++;
+}
+
+// Removes a buffer from the hash and the dirty list, before it is reused or invalidated.
+static void pfsCacheForget(pfs_cache_t *clink)
+{
+    if (clink->pfsMount != NULL) {
+        pfsCacheHashRemove(clink);
+        pfsCacheDirtyRemove(clink);
+        clink->pfsMount = NULL;
+    }
+}
+
 void pfsCacheFree(pfs_cache_t *clink)
 {
     if (clink == NULL) {
@@ -107,26 +208,109 @@ int pfsCacheTransfer(pfs_cache_t *clink, int mode)
     return pfsMount->lastError;
 }
 
-void pfsCacheFlushAllDirty(pfs_mount_t *pfsMount)
+// Non-SONY: sorts the buffers by (sub, block), so that the disk is written in one direction.
+static void pfsCacheSort(pfs_cache_t **list, u32 count)
 {
-    u32 i;
-    int found = 0;
+    pfs_cache_t *clink;
+    u32 i, j;
 
-    for (i = 1; i < pfsCacheNumBuffers + 1; i++) {
-        if (pfsCacheBuf[i].pfsMount == pfsMount &&
-            pfsCacheBuf[i].flags & PFS_CACHE_FLAG_DIRTY)
-            found = 1;
+    for (i = 1; i < count; i++) {
+        clink = list[i];
+        for (j = i; j > 0 && (list[j - 1]->sub > clink->sub || (list[j - 1]->sub == clink->sub && list[j - 1]->block > clink->block)); j--)
+            list[j] = list[j - 1];
+        list[j] = clink;
+    }
+}
+
+// Non-SONY: writes the buffers that were committed to the journal. Runs of neighbouring blocks are copied to the gather buffer and written with one transfer.
+static void pfsCacheWriteList(pfs_cache_t **list, u32 count)
+{
+    pfs_mount_t *pfsMount;
+    u32 i, j, run, size;
+    int err;
+
+    pfsCacheSort(list, count);
+
+    size = 512 << pfsBlockSize;
+    for (i = 0; i < count; i += run) {
+        for (run = 1; i + run < count && run < PFS_CACHE_GATHER_BLOCKS; run++) {
+            if (list[i + run]->sub != list[i]->sub || list[i + run]->block != list[i]->block + run)
+                break;
+        }
+
+        if (run == 1 || pfsCacheGather == NULL) {
+            run = 1;
+            pfsCacheTransfer(list[i], PFS_IO_MODE_WRITE);
+            continue;
+        }
+
+        pfsMount = list[i]->pfsMount;
+        if (pfsMount->lastError == 0) {
+            for (j = 0; j < run; j++)
+                memcpy(&pfsCacheGather[j * size], list[i + j]->u.data, size);
+
+            if ((err = pfsMount->blockDev->transfer(pfsMount->fd, pfsCacheGather, list[i]->sub,
+                                                    list[i]->block << pfsBlockSize, run << pfsBlockSize, PFS_IO_MODE_WRITE)) != 0) {
+                PFS_PRINTF(PFS_DRV_NAME ": Error: Disk error partition %ld, block %ld, err %d\n",
+                           list[i]->sub, list[i]->block, err);
+#ifndef PFS_NO_WRITE_ERROR_STAT
+                pfsMount->blockDev->setPartitionError(pfsMount->fd);
+                pfsFsckStat(pfsMount, (pfs_super_block_t *)pfsCacheGather, PFS_FSCK_STAT_WRITE_ERROR, PFS_MODE_SET_FLAG);
+                pfsMount->lastError = err;
+#endif
+            }
+        }
+
+        for (j = 0; j < run; j++)
+            list[i + j]->flags &= ~PFS_CACHE_FLAG_DIRTY;
     }
-    if (found) {
-        pfsJournalWrite(pfsMount, pfsCacheBuf + 1, pfsCacheNumBuffers);
-        for (i = 1; i < pfsCacheNumBuffers + 1; i++) {
-            if (pfsCacheBuf[i].pfsMount == pfsMount &&
-                pfsCacheBuf[i].flags & PFS_CACHE_FLAG_DIRTY)
-                pfsCacheTransfer(&pfsCacheBuf[i], 1);
+}
+
+void pfsCacheFlushAllDirty(pfs_mount_t *pfsMount)
+{
+    pfs_cache_t *clink;
+    u32 count;
+    int committed;
+
+    // Non-SONY: the dirty list normally fits in one journal commit. More are only written when more than that are held.
+    committed = 0;
+    do {
+        for (count = 0, clink = pfsCacheDirty.dnext; clink != &pfsCacheDirty && count < PFS_JOURNAL_MAX_ENTRIES; clink = clink->dnext) {
+            if (clink->pfsMount == pfsMount && (clink->flags & PFS_CACHE_FLAG_DIRTY))
+                pfsCacheCommit[count++] = clink;
         }
+
+        if (count != 0) {
+            pfsJournalWrite(pfsMount, pfsCacheCommit, count);
+            pfsCacheWriteList(pfsCacheCommit, count);
+            pfsJournalReset(pfsMount);
+            committed = 1;
+        }
+    } while (count == PFS_JOURNAL_MAX_ENTRIES);
+
+    // Non-SONY: the journal is already empty, so only the disk's write cache is flushed.
+    if (!committed)
+        pfsMount->blockDev->flushCache(pfsMount->fd);
+    pfsCacheDirtyTrim();
+}
+
+// Non-SONY: writes back a dirty buffer that is to be reused, in one journal commit with the oldest other dirty buffers that are not held.
+// Everything else stays dirty until the next pfsCacheFlushAllDirty().
+static void pfsCacheWriteBack(pfs_cache_t *victim)
+{
+    pfs_cache_t *clink;
+    u32 count;
+
+    pfsCacheCommit[0] = victim;
+    count             = 1;
+    for (clink = pfsCacheDirty.dnext; clink != &pfsCacheDirty && count < PFS_CACHE_WRITEBACK_GROUP; clink = clink->dnext) {
+        if (clink != victim && clink->pfsMount == victim->pfsMount && clink->nused == 0 && (clink->flags & PFS_CACHE_FLAG_DIRTY))
+            pfsCacheCommit[count++] = clink;
     }
 
-    pfsJournalReset(pfsMount);
+    pfsJournalWrite(victim->pfsMount, pfsCacheCommit, count);
+    pfsCacheWriteList(pfsCacheCommit, count);
+    pfsJournalReset(victim->pfsMount);
 }
 
 pfs_cache_t *pfsCacheAlloc(pfs_mount_t *pfsMount, u16 sub, u32 block,
@@ -143,34 +327,39 @@ pfs_cache_t *pfsCacheAlloc(pfs_mount_t *pfsMount, u16 sub, u32 block,
     if (pfsCacheBuf->next == NULL)
         PFS_PRINTF(PFS_DRV_NAME ": Panic: Null pointer allocated\n");
     if (allocated->pfsMount && (allocated->flags & PFS_CACHE_FLAG_DIRTY))
-        pfsCacheFlushAllDirty(allocated->pfsMount);
+        pfsCacheWriteBack(allocated);
+    pfsCacheForget(allocated);
     allocated->flags    = flags & PFS_CACHE_FLAG_MASKTYPE;
     allocated->pfsMount = pfsMount;
     allocated->sub      = sub;
     allocated->block    = block;
     allocated->nused    = 1;
-    return pfsCacheUnLink(allocated);
+    pfsCacheUnLink(allocated);
+    if (pfsMount != NULL) {
+        pfsCacheHashAdd(allocated);
+        pfsCacheDirtyAdd(allocated);
+    }
+    return allocated;
 }
 
 pfs_cache_t *pfsCacheGetData(pfs_mount_t *pfsMount, u16 sub, u32 block,
                              int flags, int *result)
 {
-    u32 i;
     pfs_cache_t *clink;
 
     *result = 0;
 
-    for (i = 1; i < pfsCacheNumBuffers + 1; i++)
-        if (pfsCacheBuf[i].pfsMount &&
-            (pfsCacheBuf[i].pfsMount == pfsMount) &&
-            (pfsCacheBuf[i].block == block))
-            if (pfsCacheBuf[i].sub == sub) {
-                pfsCacheBuf[i].flags &= PFS_CACHE_FLAG_MASKSTATUS;
-                pfsCacheBuf[i].flags |= flags & PFS_CACHE_FLAG_MASKTYPE;
-                if (pfsCacheBuf[i].nused == 0)
-                    pfsCacheUnLink(&pfsCacheBuf[i]);
-                pfsCacheBuf[i].nused++;
-                return &pfsCacheBuf[i];
+    for (clink = *pfsCacheHashHead(sub, block); clink != NULL; clink = clink->hnext)
+        if ((clink->pfsMount == pfsMount) &&
+            (clink->block == block))
+            if (clink->sub == sub) {
+                clink->flags &= PFS_CACHE_FLAG_MASKSTATUS;
+                clink->flags |= flags & PFS_CACHE_FLAG_MASKTYPE;
+                if (clink->nused == 0)
+                    pfsCacheUnLink(clink);
+                clink->nused++;
+                pfsCacheDirtyAdd(clink);
+                return clink;
             }
 
     clink = pfsCacheAlloc(pfsMount, sub, block, flags, result);
@@ -182,7 +371,7 @@ pfs_cache_t *pfsCacheGetData(pfs_mount_t *pfsMount, u16 sub, u32 block,
         if ((*result = pfsCacheTransfer(clink, PFS_IO_MODE_READ)) >= 0)
             return clink;
 
-        clink->pfsMount = NULL;
+        pfsCacheForget(clink);
         pfsCacheFree(clink);
     }
     return NULL;
@@ -205,24 +394,37 @@ int pfsCacheIsFull(void)
 int pfsCacheInit(u32 numBuf, u32 bufSize)
 {
     char *cacheData;
-    u32 i;
+    u32 i, HashSize;
 
-    if (numBuf > 127) {
-        PFS_PRINTF(PFS_DRV_NAME ": Error: Number of buffers larger than 127.\n");
+    if (numBuf > PFS_CACHE_MAX_BUFFERS) {
+        PFS_PRINTF(PFS_DRV_NAME ": Error: Number of buffers larger than %d.\n", PFS_CACHE_MAX_BUFFERS);
         return -EINVAL;
     }
 
+    // One hash chain for every buffer, rounded up to a power of 2.
+    for (HashSize = 1; HashSize < numBuf; HashSize <<= 1)
+        ;
+
     cacheData = pfsAllocMem(numBuf * bufSize);
 
-    if (!cacheData || !(pfsCacheBuf = pfsAllocMem((numBuf + 1) * sizeof(pfs_cache_t))))
+    if (!cacheData || !(pfsCacheBuf = pfsAllocMem((numBuf + 1) * sizeof(pfs_cache_t))) || !(pfsCacheHash = pfsAllocMem(HashSize * sizeof(pfs_cache_t *))))
         return -ENOMEM;
 
     pfsCacheNumBuffers = numBuf;
     memset(pfsCacheBuf, 0, (numBuf + 1) * sizeof(pfs_cache_t));
+    memset(pfsCacheHash, 0, HashSize * sizeof(pfs_cache_t *));
+    pfsCacheHashMask = HashSize - 1;
 
     pfsCacheBuf->next = pfsCacheBuf;
     pfsCacheBuf->prev = pfsCacheBuf;
 
+    pfsCacheDirty.dnext = &pfsCacheDirty;
+    pfsCacheDirty.dprev = &pfsCacheDirty;
+    pfsCacheNumDirty    = 0;
+
+    // Without it, every block is written by itself.
+    pfsCacheGather = pfsAllocMem(PFS_CACHE_GATHER_BLOCKS * bufSize);
+
     for (i = 1; i < numBuf + 1; i++) {
         pfsCacheBuf[i].u.data = cacheData;
         pfsCacheLink(pfsCacheBuf->prev, &pfsCacheBuf[i]);
@@ -237,20 +439,24 @@ void pfsCacheClose(pfs_mount_t *pfsMount)
     unsigned int i;
 
     pfsCacheFlushAllDirty(pfsMount);
+    pfsMount->blockDev->flushCache(pfsMount->fd); // Non-SONY: pfsJournalReset() leaves the empty journal header in the disk's write cache.
+    pfsBlockResetExtents();
+    pfsBitmapIndexReset(pfsMount);
     for (i = 1; i < pfsCacheNumBuffers + 1; i++) {
         if (pfsCacheBuf[i].pfsMount == pfsMount)
-            pfsCacheBuf[i].pfsMount = NULL;
+            pfsCacheForget(&pfsCacheBuf[i]);
     }
 }
 
 void pfsCacheMarkClean(pfs_mount_t *pfsMount, u32 subpart, u32 blockStart, u32 blockEnd)
 {
-    u32 i;
+    pfs_cache_t *clink;
 
-    for (i = 1; i < pfsCacheNumBuffers + 1; i++) {
-        if (pfsCacheBuf[i].pfsMount == pfsMount && pfsCacheBuf[i].sub == subpart) {
-            if (pfsCacheBuf[i].block >= blockStart && pfsCacheBuf[i].block < blockEnd)
-                pfsCacheBuf[i].flags &= ~PFS_CACHE_FLAG_DIRTY;
+    // Non-SONY: only the buffers on the dirty list can be dirty.
+    for (clink = pfsCacheDirty.dnext; clink != &pfsCacheDirty; clink = clink->dnext) {
+        if (clink->pfsMount == pfsMount && clink->sub == subpart) {
+            if (clink->block >= blockStart && clink->block < blockEnd)
+                clink->flags &= ~PFS_CACHE_FLAG_DIRTY;
         }
     }
 }
@@ -24,6 +24,160 @@
 
 extern u32 pfsMetaSize;
 
+// Non-SONY: an index of the names in the last few directories that were scanned, giving the position of each dentry.
+// pfsDirAddEntry() and pfsDirRemoveEntry() keep it up to date, pfsInodeRemove() drops the index of a removed directory
+// and pfsDirIndexReset() frees it at unmount. Every hit is still checked against the dentry on the disk.
+#define PFS_DIR_INDEX_DIRS  4
+#define PFS_DIR_INDEX_SLOTS 1024 // must be a power of 2
+#define PFS_DIR_INDEX_FREED 0xFFFFFFFF
+
+typedef struct
+{
+    u32 hash;     // 0 if the slot was never used
+    u32 position; // byte offset of the dentry in the directory, or PFS_DIR_INDEX_FREED
+} pfs_dir_index_slot_t;
+
+typedef struct
+{
+    pfs_mount_t *pfsMount;
+    u32 sub;   // location of the directory inode
+    u32 block; //
+    u32 used;  // slots in use, including freed ones
+    pfs_dir_index_slot_t *slot;
+} pfs_dir_index_t;
+
+static pfs_dir_index_t pfsDirIndex[PFS_DIR_INDEX_DIRS];
+static u32 pfsDirIndexNext;
+
+static u32 pfsDirIndexHash(const char *path, u32 len)
+{
+    u32 hash;
+
+    for (hash = 0x811C9DC5; len > 0; len--)
+        hash = (hash ^ (u8)*path++) * 0x01000193; // FNV-1a
+
+    return hash != 0 ? hash : 1;
+}
+
+static pfs_dir_index_t *pfsDirIndexGet(pfs_cache_t *dir, int create)
+{
+    pfs_dir_index_t *index;
+    u32 i;
+
+    for (i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+        index = &pfsDirIndex[i];
+        if (index->slot != NULL && index->pfsMount == dir->pfsMount && index->sub == dir->sub && index->block == dir->block)
+            return index;
+    }
+
+    if (!create)
+        return NULL;
+
+    index           = &pfsDirIndex[pfsDirIndexNext];
+    pfsDirIndexNext = (pfsDirIndexNext + 1) % PFS_DIR_INDEX_DIRS;
+    if (index->slot == NULL && (index->slot = pfsAllocMem(PFS_DIR_INDEX_SLOTS * sizeof(pfs_dir_index_slot_t))) == NULL)
+        return NULL;
+
+    memset(index->slot, 0, PFS_DIR_INDEX_SLOTS * sizeof(pfs_dir_index_slot_t));
+    index->pfsMount = dir->pfsMount;
+    index->sub      = dir->sub;
+    index->block    = dir->block;
+    index->used     = 0;
+
+    return index;
+}
+
+static void pfsDirIndexForget(pfs_cache_t *dir)
+{
+    pfs_dir_index_t *index;
+
+    if ((index = pfsDirIndexGet(dir, 0)) != NULL)
+        index->pfsMount = NULL;
+}
+
+void pfsDirIndexReset(void)
+{
+    u32 i;
+
+    for (i = 0; i < PFS_DIR_INDEX_DIRS; i++) {
+        if (pfsDirIndex[i].slot != NULL)
+            pfsFreeMem(pfsDirIndex[i].slot);
+        memset(&pfsDirIndex[i], 0, sizeof(pfs_dir_index_t));
+    }
+    pfsDirIndexNext = 0;
+}
+
+static void pfsDirIndexAdd(pfs_dir_index_t *index, const char *path, u32 len, u32 position)
+{
+    u32 i, hash;
+
+    // A full table would make every probe long. Names that do not fit are found by a scan.
+    if (index == NULL || len == 0 || index->used >= PFS_DIR_INDEX_SLOTS / 4 * 3)
+        return;
+
+    hash = pfsDirIndexHash(path, len);
+    for (i = hash & (PFS_DIR_INDEX_SLOTS - 1); index->slot[i].hash != 0; i = (i + 1) & (PFS_DIR_INDEX_SLOTS - 1)) {
+        if (index->slot[i].hash == hash && index->slot[i].position == position)
+            return;
+    }
+
+    index->slot[i].hash     = hash;
+    index->slot[i].position = position;
+    index->used++;
+}
+
+static void pfsDirIndexRemove(pfs_cache_t *dir, const char *path, u32 position)
+{
+    pfs_dir_index_t *index;
+    u32 i, hash;
+
+    if ((index = pfsDirIndexGet(dir, 0)) == NULL)
+        return;
+
+    hash = pfsDirIndexHash(path, strlen(path));
+    for (i = hash & (PFS_DIR_INDEX_SLOTS - 1); index->slot[i].hash != 0; i = (i + 1) & (PFS_DIR_INDEX_SLOTS - 1)) {
+        if (index->slot[i].hash == hash && index->slot[i].position == position)
+            index->slot[i].position = PFS_DIR_INDEX_FREED;
+    }
+}
+
+// Returns the dentry chunk holding the dentry for path, if the index knows where it is. Otherwise, the directory must be scanned.
+static pfs_cache_t *pfsDirIndexFind(pfs_cache_t *dir, const char *path, u32 len, pfs_dentry_t **dentry, u32 *size)
+{
+    pfs_dir_index_t *index;
+    pfs_dentry_t *d, *target;
+    pfs_cache_t *dcache;
+    u32 i, hash;
+    int offset, result;
+
+    if ((index = pfsDirIndexGet(dir, 0)) == NULL)
+        return NULL;
+
+    hash = pfsDirIndexHash(path, len);
+    for (i = hash & (PFS_DIR_INDEX_SLOTS - 1); index->slot[i].hash != 0; i = (i + 1) & (PFS_DIR_INDEX_SLOTS - 1)) {
+        if (index->slot[i].hash != hash || index->slot[i].position >= dir->u.inode->size)
+            continue;
+
+        if ((dcache = pfsGetDentriesAtPos(dir, index->slot[i].position, &offset, &result)) == NULL)
+            continue;
+
+        // The position must still be the start of a dentry. Dentries do not cross sectors, so walk its sector to it.
+        target = (pfs_dentry_t *)((u8 *)dcache->u.data + offset);
+        for (d = (pfs_dentry_t *)((u8 *)dcache->u.data + (offset & ~511)); d < target && (d->aLen & 0xFFF) != 0 && (d->aLen & 3) == 0;)
+            d = (pfs_dentry_t *)((u8 *)d + (d->aLen & 0xFFF));
+
+        if (d == target && d->pLen == len && memcmp(path, d->path, len) == 0) {
+            *dentry = d;
+            *size   = index->slot[i].position;
+            return dcache;
+        }
+
+        pfsCacheFree(dcache);
+    }
+
+    return NULL;
+}
+
 // Gets a dir entry from the inode specified by clink
 pfs_cache_t *pfsGetDentry(pfs_cache_t *clink, char *path, pfs_dentry_t **dentry, u32 *size, int option)
 {
@@ -32,6 +186,7 @@ pfs_cache_t *pfsGetDentry(pfs_cache_t *clink, char *path, pfs_dentry_t **dentry,
     u16 aLen;
     pfs_dentry_t *d2;
     pfs_cache_t *dentCache;
+    pfs_dir_index_t *index;
     u32 new_dentryLen = 0, dentryLen;
     int len           = 0, result;
 
@@ -41,6 +196,11 @@ pfs_cache_t *pfsGetDentry(pfs_cache_t *clink, char *path, pfs_dentry_t **dentry,
     }
     *size = 0;
 
+    // Non-SONY: look the name up in the index, then record the names that the scan passes.
+    if (option == 0 && path != NULL && (dentCache = pfsDirIndexFind(clink, path, len, dentry, size)) != NULL)
+        return dentCache;
+    index = pfsDirIndexGet(clink, 1);
+
     block_pos.inode         = pfsCacheUsedAdd(clink);
     block_pos.block_segment = 1;
     block_pos.block_offset  = 0;
@@ -79,6 +239,9 @@ pfs_cache_t *pfsGetDentry(pfs_cache_t *clink, char *path, pfs_dentry_t **dentry,
                     goto _exit;
                 }
 
+                if (d->inode)
+                    pfsDirIndexAdd(index, d->path, d->pLen, *size);
+
                 // decide if the current dentry meets the required criteria, based on 'option'
                 switch (option) {
                     case 0: // result = 1 when paths are equal
@@ -167,6 +330,7 @@ pfs_cache_t *pfsDirAddEntry(pfs_cache_t *dir, char *filename, pfs_blockinfo_t *b
         len = dentry->aLen & 0xFFF;
         if (dentry->pLen)
             len -= (dentry->pLen + 11) & 0x1FC;
+        size += (dentry->aLen & 0xFFF) - len;
         dentry->aLen = (dentry->aLen & FIO_S_IFMT) | ((dentry->aLen & 0xFFF) - len);
         dentry       = (pfs_dentry_t *)((u8 *)dentry + (dentry->aLen & 0xFFF));
     } else {
@@ -178,11 +342,15 @@ pfs_cache_t *pfsDirAddEntry(pfs_cache_t *dir, char *filename, pfs_blockinfo_t *b
         if (dcache == NULL)
             return NULL;
 
+        size = dir->u.inode->size;
         dir->u.inode->size += sizeof(pfs_dentry_t);
 
         dentry = (pfs_dentry_t *)((u8 *)dcache->u.dentry + offset);
         len    = sizeof(pfs_dentry_t);
     }
+
+    // Non-SONY: size is now the position of the new dentry.
+    pfsDirIndexAdd(pfsDirIndexGet(dir, 0), filename, strlen(filename), size);
     return pfsFillDentry(dcache, dentry, filename, bi, len, mode);
 }
 
@@ -196,6 +364,7 @@ pfs_cache_t *pfsDirRemoveEntry(pfs_cache_t *clink, char *path)
     pfs_cache_t *c;
 
     if ((c = pfsGetDentry(clink, path, &dentry, &size, 0)) != NULL) {
+        pfsDirIndexRemove(clink, path, size); // Non-SONY
         val = (int)dentry - (int)c->u.dentry;
         if (val < 0)
             val += 511;
@@ -465,6 +634,7 @@ int pfsInodeRemove(pfs_cache_t *parent, pfs_cache_t *inode, char *path)
     pfsCacheFree(parent);
     if (rv == 0) {
         inode->flags &= ~PFS_CACHE_FLAG_DIRTY;
+        pfsDirIndexForget(inode); // Non-SONY: its blocks may be used by another directory.
         pfsBitmapFreeInodeBlocks(inode);
         // if (parent->pfsMount->flags & PFS_FIO_ATTR_WRITEABLE) // Not checked for in late versions of PFS.
         pfsCacheFlushAllDirty(parent->pfsMount);
@@ -673,6 +843,7 @@ void pfsFreeZones(pfs_cache_t *pfree)
     pfree->u.inode->last_segment.subpart = clink->u.inode->data[0].subpart;
     pfree->u.inode->last_segment.count   = clink->u.inode->data[0].count;
     pfree->flags |= PFS_CACHE_FLAG_DIRTY;
+    pfsBlockForgetExtents(); // Non-SONY: the segments were cut short.
 
     if (b.number)
         pfsBitmapFreeBlockSegment(pfsMount, &b);
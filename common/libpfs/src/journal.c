@@ -22,11 +22,14 @@
 #include "libpfs.h"
 
 extern u32 pfsBlockSize;
+extern u8 *pfsCacheGather;
 
 ///////////////////////////////////////////////////////////////////////////////
 //    Globals
 
 pfs_journal_t pfsJournalBuf;
+static u32 pfsJournalNext = PFS_JOURNAL_MAX_ENTRIES; // Non-SONY: log block that the next commit starts at. Where the last commit was is not known when mounting.
+static int pfsJournalUnsynced;                         // Non-SONY: the empty header was written, but the disk's cache was not flushed since.
 
 ///////////////////////////////////////////////////////////////////////////////
 //    Function defenitions
@@ -41,29 +44,51 @@ int pfsJournalChecksum(void *header)
     return sum & 0xFFFF;
 }
 
-void pfsJournalWrite(pfs_mount_t *pfsMount, pfs_cache_t *clink, u32 pfsCacheNumBuffers)
+// Non-SONY: writes only the given buffers to the log area, which holds up to PFS_JOURNAL_MAX_ENTRIES blocks.
+// They are packed into the gather buffer and written with as few transfers as it allows.
+// A commit is placed after the previous one where it fits. The header of the previous commit may not yet be replaced on the disk, so its blocks must stay intact until the disk's cache is flushed.
+void pfsJournalWrite(pfs_mount_t *pfsMount, pfs_cache_t **clink, u32 count)
 {
-    u32 i         = 0;
-    u32 logSector = 2;
-
-    for (i = 0; i < pfsCacheNumBuffers; i++) {
-        if ((clink[i].flags & PFS_CACHE_FLAG_DIRTY) && clink[i].pfsMount == pfsMount) {
-            if (clink[i].flags & (PFS_CACHE_FLAG_SEGD | PFS_CACHE_FLAG_SEGI))
-                clink[i].u.inode->checksum = pfsInodeCheckSum(clink[i].u.inode);
-            pfsJournalBuf.log[pfsJournalBuf.num].sector    = clink[i].block << pfsBlockSize;
-            pfsJournalBuf.log[pfsJournalBuf.num].sub       = clink[i].sub;
-            pfsJournalBuf.log[pfsJournalBuf.num].logSector = logSector;
-            pfsJournalBuf.num += 1;
-        }
-        logSector += 2;
+    u32 i, j, run, size, logSector;
+
+    if (pfsJournalNext + count > PFS_JOURNAL_MAX_ENTRIES) {
+        if (pfsJournalUnsynced)
+            pfsMount->blockDev->flushCache(pfsMount->fd);
+        pfsJournalUnsynced = 0;
+        pfsJournalNext     = 0;
+    }
+
+    size      = 512 << pfsBlockSize;
+    logSector = 2 + (pfsJournalNext << pfsBlockSize);
+    for (i = 0; i < count; i++) {
+        if (clink[i]->flags & (PFS_CACHE_FLAG_SEGD | PFS_CACHE_FLAG_SEGI))
+            clink[i]->u.inode->checksum = pfsInodeCheckSum(clink[i]->u.inode);
+        pfsJournalBuf.log[pfsJournalBuf.num].sector    = clink[i]->block << pfsBlockSize;
+        pfsJournalBuf.log[pfsJournalBuf.num].sub       = clink[i]->sub;
+        pfsJournalBuf.log[pfsJournalBuf.num].logSector = logSector + (i << pfsBlockSize);
+        pfsJournalBuf.num += 1;
+    }
+
+    for (i = 0; i < count; i += run) {
+        if (pfsCacheGather != NULL) {
+            run = (count - i < PFS_CACHE_GATHER_BLOCKS) ? count - i : PFS_CACHE_GATHER_BLOCKS;
+            for (j = 0; j < run; j++)
+                memcpy(&pfsCacheGather[j * size], clink[i + j]->u.data, size);
+        } else
+            run = 1;
+
+        if (pfsMount->blockDev->transfer(pfsMount->fd, pfsCacheGather != NULL ? pfsCacheGather : clink[i]->u.data, 0,
+                                         (pfsMount->log.number << pfsMount->sector_scale) + logSector + (i << pfsBlockSize), run << pfsBlockSize,
+                                         PFS_IO_MODE_WRITE) < 0)
+            return;
     }
 
-    if (pfsMount->blockDev->transfer(pfsMount->fd, clink->u.inode, 0,
-                                     (pfsMount->log.number << pfsMount->sector_scale) + 2, pfsCacheNumBuffers * 2,
-                                     PFS_IO_MODE_WRITE) >= 0)
-        pfsJournalFlush(pfsMount);
+    pfsJournalNext += count;
+    pfsJournalFlush(pfsMount);
 }
 
+// Non-SONY: the empty header is left in the disk's cache. Replaying the commit again after a power failure is harmless,
+// since its blocks were written to the disk before this. The next flush of the disk's cache makes it permanent.
 int pfsJournalReset(pfs_mount_t *pfsMount)
 {
     int rv;
@@ -76,7 +101,7 @@ int pfsJournalReset(pfs_mount_t *pfsMount)
     rv = pfsMount->blockDev->transfer(pfsMount->fd, &pfsJournalBuf, 0,
                                       (pfsMount->log.number << pfsMount->sector_scale), 2, PFS_IO_MODE_WRITE);
 
-    pfsMount->blockDev->flushCache(pfsMount->fd);
+    pfsJournalUnsynced = 1;
     return rv;
 }
 
@@ -87,6 +112,28 @@ int pfsJournalResetThis(pfs_block_device_t *blockDev, int fd, u32 sector)
     return blockDev->transfer(fd, &pfsJournalBuf, 0, sector, 2, 1);
 }
 
+// Non-SONY: returns the stamp of an empty log header, or 0 if the header is not empty or has no stamp.
+u32 pfsJournalGetStamp(pfs_mount_t *pfsMount)
+{
+    if (pfsMount->blockDev->transfer(pfsMount->fd, &pfsJournalBuf, 0,
+                                     (pfsMount->log.number << pfsMount->sector_scale), 2, PFS_IO_MODE_READ) ||
+        (pfsJournalBuf.magic != PFS_JOUNRNAL_MAGIC) || (pfsJournalBuf.num != 0) ||
+        (pfsJournalBuf.checksum != (u16)pfsJournalChecksum(&pfsJournalBuf)))
+        return 0;
+
+    return pfsJournalBuf.log[PFS_JOURNAL_STAMP].sector;
+}
+
+// Non-SONY: writes an empty log header that carries the stamp. The log must have been reset and flushed before this.
+int pfsJournalWriteStamp(pfs_mount_t *pfsMount, u32 stamp)
+{
+    memset(&pfsJournalBuf, 0, sizeof(pfs_journal_t));
+    pfsJournalBuf.magic                         = PFS_JOUNRNAL_MAGIC;
+    pfsJournalBuf.log[PFS_JOURNAL_STAMP].sector = stamp;
+
+    return pfsJournalFlush(pfsMount);
+}
+
 int pfsJournalFlush(pfs_mount_t *pfsMount)
 { // this write any thing that in are journal buffer :)
     int rv;
@@ -99,6 +146,7 @@ int pfsJournalFlush(pfs_mount_t *pfsMount)
                                       (pfsMount->log.number << pfsMount->sector_scale), 2, PFS_IO_MODE_WRITE);
 
     pfsMount->blockDev->flushCache(pfsMount->fd);
+    pfsJournalUnsynced = 0;
     return rv;
 }
 
@@ -109,6 +157,9 @@ int pfsJournalRestore(pfs_mount_t *pfsMount)
     pfs_cache_t *clink;
     u32 i;
 
+    // Non-SONY: the header on the disk may refer to any part of the log area until the reset below is flushed.
+    pfsJournalNext = PFS_JOURNAL_MAX_ENTRIES;
+
     // Read journal buffer from disk
     rv = pfsMount->blockDev->transfer(pfsMount->fd, &pfsJournalBuf, 0,
                                       (pfsMount->log.number << pfsMount->sector_scale), 2, PFS_IO_MODE_READ);
@@ -169,6 +169,7 @@ int pfsMountSuperBlock(pfs_mount_t *pfsMount)
     pfs_super_block_t *superblock;
     u32 sub;
     u32 i;
+    int cached;
 
 
     // Get number of sub partitions attached to the main partition
@@ -206,6 +207,9 @@ int pfsMountSuperBlock(pfs_mount_t *pfsMount)
     if (result)
         goto error;
 
+    // Non-SONY: the counts saved by pfsSaveFreeZones() do not cover subs added since.
+    cached = superblock->num_subs == sub && superblock->free_stamp != 0;
+
     // If new subs have been added, update filesystem
     if (superblock->num_subs < sub) {
         PFS_PRINTF(PFS_DRV_NAME ": New subs added, updating filesystem..\n");
@@ -224,16 +228,25 @@ int pfsMountSuperBlock(pfs_mount_t *pfsMount)
     memcpy(&pfsMount->current_dir, &superblock->root, sizeof(pfs_blockinfo_t));
     pfsMount->total_zones = 0;
 
+    // Non-SONY: the stamp must be read before the journal restore replaces the log header.
+    if (cached)
+        cached = pfsJournalGetStamp(pfsMount) == superblock->free_stamp;
+
     // Do a journal restore (in case of un-clean unmount)
     pfsJournalRestore(pfsMount);
 
     // Calculate free space and total size
+    pfsBitmapIndexReset(pfsMount);
     for (i = 0; i < (pfsMount->num_subs + 1); i++) {
-        int free;
+        u32 free, size;
 
-        pfsMount->total_zones += pfsMount->blockDev->getSize(pfsMount->fd, i) >> pfsMount->sector_scale;
+        size = pfsMount->blockDev->getSize(pfsMount->fd, i) >> pfsMount->sector_scale;
+        pfsMount->total_zones += size;
 
-        free                   = pfsBitmapCalcFreeZones(pfsMount, i);
+        if (cached && superblock->free_zone[i] <= size)
+            free = superblock->free_zone[i];
+        else
+            free = pfsBitmapCalcFreeZones(pfsMount, i);
         pfsMount->free_zone[i] = free;
         pfsMount->zfree += free;
     }
@@ -242,3 +255,42 @@ error:
     pfsCacheFree(clink);
     return result;
 }
+
+// Non-SONY: writes the free zone counts into the superblock, so that the next mount does not have to count them.
+// The counts are only used if the log header still carries their stamp. Any mount resets the log header, including those by drivers that do not know of the stamp.
+int pfsSaveFreeZones(pfs_mount_t *pfsMount)
+{
+    int result;
+    pfs_cache_t *clink;
+    pfs_super_block_t *superblock;
+    u32 i;
+
+    // The counts must describe the bitmaps on the disk.
+    pfsCacheFlushAllDirty(pfsMount);
+
+    if ((clink = pfsCacheAllocClean(&result)) == NULL)
+        return result;
+
+    superblock = clink->u.superblock;
+    if ((result = pfsMount->blockDev->transfer(pfsMount->fd, superblock, 0, PFS_SUPER_SECTOR, 1, PFS_IO_MODE_READ)) == 0) {
+        if ((superblock->magic != PFS_SUPER_MAGIC) || (superblock->num_subs != pfsMount->num_subs) ||
+            (superblock->pfsFsckStat & PFS_FSCK_STAT_WRITE_ERROR))
+            result = -EINVAL;
+    }
+
+    if (result == 0) {
+        if (++superblock->free_stamp == 0)
+            superblock->free_stamp = 1;
+        memset(superblock->free_zone, 0, sizeof(superblock->free_zone));
+        for (i = 0; i < pfsMount->num_subs + 1; i++)
+            superblock->free_zone[i] = pfsMount->free_zone[i];
+
+        // The superblock must reach the disk before the log header that validates it.
+        pfsMount->blockDev->flushCache(pfsMount->fd);
+        if ((result = pfsMount->blockDev->transfer(pfsMount->fd, superblock, 0, PFS_SUPER_SECTOR, 1, PFS_IO_MODE_WRITE)) == 0)
+            result = pfsJournalWriteStamp(pfsMount, superblock->free_stamp);
+    }
+
+    pfsCacheFree(clink);
+    return result;
+}
@@ -358,6 +358,7 @@ static void fsckFillInode(pfs_cache_t *inodeClink, pfs_cache_t *blockClink, u32
     inodeClink->u.inode->last_segment.number  = blockClink->block >> blockClink->pfsMount->inode_scale;
     blockClink->flags |= PFS_CACHE_FLAG_DIRTY;
     inodeClink->flags |= PFS_CACHE_FLAG_DIRTY;
+    pfsBlockForgetExtents(); // Non-SONY: the segments were cut short without the bitmap being changed.
 }
 
 // 0x00000b04    - I hate this function and it hates me.
@@ -842,14 +843,18 @@ static int FsckUnsupported(void)
 }
 
 // 0x00000340
+// Non-SONY: the free zones are counted from the bitmap while it is read, instead of being read again to count them.
 static int fsckCheckBitmap(pfs_mount_t *mount, void *buffer)
 {
-    u32 i, count, block, BitmapStart, sector;
-    int result;
+    u32 i, count, block, BitmapStart, sector, size, BitmapSize;
+    int result, recount;
 
     result = 0;
     for (i = 0; i < mount->num_subs + 1; i++) {
-        block = 0;
+        mount->free_zone[i] = 0;
+        recount             = 0;
+        size                = (ZoneSizes[i] >> mount->sector_scale) / 8; // Bytes of the bitmap in use.
+        block               = 0;
         for (block = 0, count = pfsGetBitmapSizeBlocks(mount->sector_scale, ZoneSizes[i]); block < count; block++) {
             BitmapStart = block + 1;
             if (i == 0)
@@ -860,6 +865,8 @@ static int fsckCheckBitmap(pfs_mount_t *mount, void *buffer)
                 if (fsckPromptUserAction(" Overwrite", 1) == 0)
                     return result;
 
+                recount = 1;
+
                 for (sector = 0, result = 0; sector < 1 << mount->sector_scale; sector++) {
                     // 0x0000044c
                     if (mount->blockDev->transfer(mount->fd, buffer, i, (BitmapStart << mount->sector_scale) + sector, 1, PFS_IO_MODE_READ) < 0) {
@@ -870,8 +877,16 @@ static int fsckCheckBitmap(pfs_mount_t *mount, void *buffer)
                         }
                     }
                 }
+            } else if (!recount && size > block << (mount->sector_scale + 9)) {
+                BitmapSize = size - (block << (mount->sector_scale + 9));
+                if (BitmapSize > 512 << mount->sector_scale)
+                    BitmapSize = 512 << mount->sector_scale;
+                mount->free_zone[i] += pfsBitmapCountFree(buffer, BitmapSize);
             }
         }
+
+        if (recount)
+            mount->free_zone[i] = pfsBitmapCalcFreeZones(mount, i);
     }
 
     return result;
@@ -952,6 +967,7 @@ static int CheckSuperBlock(pfs_mount_t *pMainPFSMount)
     if ((result = pfsJournalRestore(pMainPFSMount)) < 0)
         return result;
 
+    pfsBitmapIndexReset(pMainPFSMount);
     memset(ZoneSizes, 0, 0x10);
     memset(ZoneMap, 0, 0x10);
 
@@ -971,7 +987,7 @@ static int CheckSuperBlock(pfs_mount_t *pMainPFSMount)
 
         for (i = 0, pFreeZones = pMainPFSMount->free_zone; i < pMainPFSMount->num_subs + 1; i++, pFreeZones++) {
             pMainPFSMount->total_zones += ZoneSizes[i] >> pMainPFSMount->sector_scale;
-            pMainPFSMount->zfree += (*pFreeZones = pfsBitmapCalcFreeZones(pMainPFSMount, i));
+            pMainPFSMount->zfree += *pFreeZones;
         }
 
         if (fsckVerbosityLevel > 0)
@@ -1014,6 +1030,7 @@ static int FsckOpen(iop_file_t *fd, const char *name, int flags, int mode)
         return blockfd;
     }
 
+    pfsBitmapIndexReset(&MainPFSMount);
     memset(&MainPFSMount, 0, sizeof(MainPFSMount));
     MainPFSMount.fd       = blockfd;
     MainPFSMount.blockDev = pblockDevData;
@@ -1057,8 +1074,8 @@ static int FsckOpen(iop_file_t *fd, const char *name, int flags, int mode)
 // 0x000024a4
 static int FsckClose(iop_file_t *fd)
 {
+    pfsCacheClose((pfs_mount_t *)fd->privdata); // Non-SONY: before close(), so that the dirty buffers and the disk's write cache are still flushed to the partition.
     close(((pfs_mount_t *)fd->privdata)->fd);
-    pfsCacheClose((pfs_mount_t *)fd->privdata);
     memset(fd->privdata, 0, sizeof(pfs_mount_t));
 
     return 0;
@@ -1177,7 +1194,8 @@ int _start(int argc, char *argv[])
         if (!strcmp("-n", *argv)) {
             argv++;
             if (--argc > 0) {
-                if (strtol(*argv, NULL, 10) < buffers)
+                // Non-SONY: the cache is no longer limited to 126 buffers.
+                if (strtol(*argv, NULL, 10) > 0 && strtol(*argv, NULL, 10) <= PFS_CACHE_MAX_BUFFERS)
                     buffers = strtol(*argv, NULL, 10);
             } else
                 return DisplayUsageHelp();
@@ -18,7 +18,9 @@ enum FSSK_IOCTL2_CMD {
     FSSK_IOCTL2_CMD_GET_STATUS, // Output = struct fsskStatus
     FSSK_IOCTL2_CMD_STOP,
     FSSK_IOCTL2_CMD_SET_MINFREE,
-    FSSK_IOCTL2_CMD_SIM
+    FSSK_IOCTL2_CMD_SIM,
+    FSSK_IOCTL2_CMD_SET_VERIFY,      // Non-SONY: input = int, non-zero to read back and check every zone that is copied.
+    FSSK_IOCTL2_CMD_SET_TARGET_SIZE, // Non-SONY: input = u32, size in MB to shrink the partition to. Only sub-partitions beyond it are removed.
 };
 
 #define FSSK_MODE_VERBOSITY(x) (((x)&0xF) << 4)
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <limits.h>
 #include <iomanX.h>
 #include <loadcore.h>
 #include <kerr.h>
@@ -12,6 +13,8 @@
 
 #include "pfs-opt.h"
 #include "libpfs.h"
+#include "crc32.h"
+#include "copy.h"
 #include "fssk-ioctl.h"
 #include "fssk.h"
 #include "misc.h"
@@ -32,14 +35,27 @@ static int fsskEventFlagID;
 static int fsskThreadID;
 static char fsskPathBuffer[FSSK_MAX_PATH_LEVELS][FSSK_MAX_PATH_SEG_LENGTH];
 static int fsskVerbosityLevel = 2;
+extern u32 pfsMetaSize;
+extern u32 pfsBlockSize;
+extern u32 pfsBitsPerBitmapChunk;
 
 static pfs_mount_t MainPFSMount = {0}; // FIXME: if not explicitly initialized to 0, the generated IRX would somehow have garbage in this structure.
 
 #define IO_BUFFER_SIZE       256
 #define IO_BUFFER_SIZE_BYTES (IO_BUFFER_SIZE * 512)
+#define FSSK_COPY_SIZE_MAX   1024 // Non-SONY: sectors per copy buffer, if the IOP has the memory for them.
 
 static struct fsskRuntimeData fsskRuntimeData;
 static u8 IOBuffer[IO_BUFFER_SIZE_BYTES];
+static int fsskVerify; // Non-SONY: read back every zone after it is written.
+static u8 *fsskVerifyBuffer;
+static u32 fsskTargetSize; // Non-SONY: size in MB to shrink the partition to. 0 to remove as many sub-partitions as possible.
+
+// Non-SONY: copying is pipelined through the writer thread in common/copy.
+#define FSSK_COPY_BUFFERS 2
+
+static u8 *fsskCopyBuffers[FSSK_COPY_BUFFERS];
+static u32 fsskCopySectors; // Size of each copy buffer.
 
 static void fsskPrintPWD(void)
 {
@@ -84,13 +100,24 @@ static int fsskHasSpaceToFree(pfs_cache_t *clink)
 
 static int fsskCalculateSpaceToRemove(pfs_mount_t *mount)
 {
-    u32 PartsToRemove, i, ratio, SizeOfSub, SizeOfSubZones, free, zfree, total_zones;
+    u32 PartsToRemove, i, ratio, SizeOfSub, SizeOfSubZones, free, zfree, total_zones, size;
 
     PartsToRemove = 0;
     zfree         = mount->zfree;
     total_zones   = mount->total_zones;
+
+    // In MB, so that it does not overflow.
+    for (size = 0, i = 0; i <= mount->num_subs; i++)
+        size += mount->blockDev->getSize(mount->fd, i) / 2048;
+
     for (i = mount->num_subs; i != 0; i--, PartsToRemove++) {
-        SizeOfSub      = mount->blockDev->getSize(mount->fd, i);
+        SizeOfSub = mount->blockDev->getSize(mount->fd, i);
+        if (fsskTargetSize != 0) {
+            size -= SizeOfSub / 2048;
+            if (size < fsskTargetSize)
+                break;
+        }
+
         SizeOfSubZones = SizeOfSub >> mount->sector_scale;
         total_zones -= SizeOfSubZones;
         SizeOfSubZones - mount->free_zone[i] - pfsGetBitmapSizeBlocks(mount->sector_scale, SizeOfSub) - 1;
@@ -130,16 +157,187 @@ static u16 fsskCalcLastSub(pfs_mount_t *mount)
     return result;
 }
 
+// Non-SONY: disk access for the copy writer thread. unit is the sub-partition.
+static int fsskCopyIO(void *device, void *buffer, u32 unit, u32 sector, u32 count, int write)
+{
+    pfs_mount_t *mount = device;
+    int result;
+
+    result = mount->blockDev->transfer(mount->fd, buffer, unit, sector, count, write ? PFS_IO_MODE_WRITE : PFS_IO_MODE_READ);
+    return result < 0 ? result : 0;
+}
+
+// Non-SONY: the zones of a segment are contiguous, so they are copied in runs as large as a buffer.
+// The segment is completely written before returning, as the caller then points the inode at it.
 static int fsskCopyBlock(pfs_mount_t *mount, pfs_blockinfo_t *block1, pfs_blockinfo_t *block2, u32 length)
 {
-    u32 i;
+    u32 i, count, zones, run, crc;
+    int result, pending;
+    u8 *buffer;
+
+    zones   = fsskCopySectors >> mount->sector_scale;
+    pending = 0;
+    result  = 0;
+    for (i = 0, run = 0; i < length; i += count, run++) {
+        count  = (length - i < zones) ? length - i : zones;
+        buffer = fsskCopyBuffers[run % FSSK_COPY_BUFFERS];
+
+        // Without a second buffer, the previous run must be written before its buffer is reused.
+        if (pending && buffer == CopyGetWriteBuffer()) {
+            pending = 0;
+            if ((result = CopyWaitWrite()) < 0)
+                break;
+        }
+
+        if ((result = mount->blockDev->transfer(mount->fd, buffer, block2->subpart, (block2->number + i) << mount->sector_scale, count << mount->sector_scale, PFS_IO_MODE_READ)) < 0)
+            break;
+
+        // While the previous run is being written and read back.
+        crc = fsskVerify ? Crc32(0, buffer, (count << mount->sector_scale) * 512) : 0;
+
+        if (pending) {
+            pending = 0;
+            if ((result = CopyWaitWrite()) < 0)
+                break;
+        }
+
+        CopyPostWrite(mount, buffer, block1->subpart, (block1->number + i) << mount->sector_scale, count << mount->sector_scale, fsskVerify ? fsskVerifyBuffer : NULL, crc);
+        pending = 1;
+    }
+
+    if (pending) {
+        if ((pending = CopyWaitWrite()) < 0 && result >= 0)
+            result = pending;
+    }
+
+    return result < 0 ? result : 0;
+}
+
+// Non-SONY: returns the length of the first free run of at least want zones in the sub-partition, from number onwards.
+// Without one, the longest run is returned instead.
+static u32 fsskBitmapFindRun(pfs_mount_t *mount, u32 sub, u32 number, u32 want, u32 *start)
+{
+    pfs_bitmapInfo_t info;
+    pfs_cache_t *bitmap;
+    u32 *bitmapWord, *bitmapEnd;
+    u32 i, n, free, sector, bitmapMax, zone, run, RunStart, best;
     int result;
 
-    for (i = 0; i < length; i++) {
-        if ((result = mount->blockDev->transfer(mount->fd, IOBuffer, block2->subpart, (block2->number + i) << mount->sector_scale, 1 << mount->sector_scale, PFS_IO_MODE_READ)) < 0 || ((result = mount->blockDev->transfer(mount->fd, IOBuffer, block1->subpart, (block1->number + i) << mount->sector_scale, 1 << mount->sector_scale, PFS_IO_MODE_WRITE)) < 0))
-            return result;
+    pfsBitmapSetupInfo(mount, &info, sub, number);
+
+    run  = 0;
+    best = 0;
+    for (; ((info.partitionRemainder == 0) && (info.chunk < info.partitionChunks)) ||
+           ((info.partitionRemainder != 0) && (info.chunk < info.partitionChunks + 1));
+         info.chunk++) {
+        sector = info.chunk + (1 << mount->inode_scale);
+        if (sub == 0)
+            sector += 0x2000 >> pfsBlockSize;
+
+        if ((bitmap = pfsCacheGetData(mount, sub, sector, PFS_CACHE_FLAG_BITMAP, &result)) == NULL)
+            break;
+
+        bitmapMax = info.chunk == info.partitionChunks ? info.partitionRemainder / 8 : pfsMetaSize;
+        bitmapEnd = (u32 *)&((u8 *)bitmap->u.bitmap)[bitmapMax];
+        for (bitmapWord = &bitmap->u.bitmap[info.index]; bitmapWord < bitmapEnd; info.bit = 0, bitmapWord++) {
+            // Runs of free zones are found a word at a time. The bits before the start are treated as used.
+            free = ~*bitmapWord & pfsBitmapMask(info.bit, 32);
+            if (free == 0) {
+                run = 0;
+                continue;
+            }
+
+            zone = info.chunk * pfsBitsPerBitmapChunk + (bitmapWord - bitmap->u.bitmap) * 32;
+            for (i = 0; i < 32; i += n) {
+                // Skip to the next free zone.
+                if (((free >> i) & 1) == 0) {
+                    run = 0;
+                    if ((free >> i) == 0)
+                        break;
+                    i += pfsBitmapLowestBit(free >> i);
+                }
+
+                if (run == 0)
+                    RunStart = zone + i;
+
+                // The length of this run of free zones within the word.
+                n = (~free >> i) ? pfsBitmapLowestBit(~free >> i) : 32 - i;
+                run += n;
+
+                // A segment cannot be longer than USHRT_MAX zones, so no run can be better than that.
+                if (run >= USHRT_MAX) {
+                    *start = RunStart;
+                    pfsCacheFree(bitmap);
+                    return USHRT_MAX;
+                }
+
+                if (run > best) {
+                    best   = run;
+                    *start = RunStart;
+                    if (best >= want) {
+                        pfsCacheFree(bitmap);
+                        return best;
+                    }
+                }
+            }
+        }
+        pfsCacheFree(bitmap);
+        info.index = 0;
+        info.bit   = 0;
     }
 
+    return best;
+}
+
+// Non-SONY: replaces fsckBitmapSearchFreeZoneSpecial(), which tried power-of-two counts of up to 32 zones and so split moved files into many segments.
+// The sub-partitions that are kept are searched for a run that can hold all of want zones, starting from the position in bi.
+// Failing that, the longest run is used, so that the file is moved in the fewest segments. Up to bi->count zones are allocated.
+static int fsskBitmapSearchFreeExtent(pfs_mount_t *mount, pfs_blockinfo_t *bi, u32 want, u32 deleted)
+{
+    u32 num, sub, start, length, best, BestSub, BestStart, i;
+
+    num = mount->num_subs + 1 - deleted;
+    if (bi->subpart >= num) {
+        bi->subpart = 0;
+        bi->number  = 0;
+    }
+    if (want < bi->count)
+        want = bi->count;
+
+    // The sub-partition in bi is searched from the given position first, and then again from its start after all the others.
+    best      = 0;
+    BestSub   = 0;
+    BestStart = 0;
+    for (i = 0; i <= num && best < want; i++) {
+        if (i == num && bi->number == 0)
+            break;
+
+        sub = (bi->subpart + i) % num;
+        if (mount->free_zone[sub] <= best)
+            continue;
+
+        if ((length = fsskBitmapFindRun(mount, sub, i == 0 ? bi->number : 0, want, &start)) > best) {
+            best      = length;
+            BestSub   = sub;
+            BestStart = start;
+        }
+    }
+
+    if (best == 0)
+        return -ENOSPC;
+
+    bi->subpart = BestSub;
+    bi->number  = BestStart;
+    if (best < bi->count)
+        bi->count = best;
+
+    // The run is free, so it is found again at once.
+    if (pfsBitmapAllocZones(mount, bi, bi->count) == 0)
+        return -ENOSPC;
+
+    mount->free_zone[bi->subpart] -= bi->count;
+    mount->zfree -= bi->count;
+
     return 0;
 }
 
@@ -153,7 +351,8 @@ static pfs_cache_t *fsskCreateIndirectSeg(pfs_cache_t *clink, pfs_cache_t *clink
     if (!pfsCacheIsFull()) {
         block.subpart = data->subpart;
         block.number  = data->number + data->count;
-        if ((*result = pfsBitmapSearchFreeZone(clink->pfsMount, &block, clink->u.inode->number_blocks)) >= 0) {
+        block.count   = 1; // Non-SONY: the new SEGI takes one zone, from the sub-partitions that are kept.
+        if ((*result = fsskBitmapSearchFreeExtent(clink->pfsMount, &block, 1, fsskRuntimeData.status.partsDeleted)) >= 0) {
             clinkfree = pfsCacheGetData(clink->pfsMount, block.subpart, block.number << clink->pfsMount->inode_scale, PFS_CACHE_FLAG_SEGI | PFS_CACHE_FLAG_NOLOAD, result);
 
             memset(clinkfree->u.inode, 0, sizeof(pfs_inode_t));
@@ -179,44 +378,11 @@ static pfs_cache_t *fsskCreateIndirectSeg(pfs_cache_t *clink, pfs_cache_t *clink
     return NULL;
 }
 
-// Very similar to pfsBitmapSearchFreeZone().
-static int fsckBitmapSearchFreeZoneSpecial(pfs_mount_t *pfsMount, pfs_blockinfo_t *bi, u32 max_count, u32 deleted)
-{
-    u32 num, count, i;
-
-    deleted--;
-    num = pfsMount->num_subs - deleted;
-    if (bi->subpart < num)
-        bi->subpart = 0;
-    if (bi->number != 0)
-        num++;
-    count = (max_count < 33) ? max_count : 32;
-    if (count < bi->count)
-        count = bi->count;
-
-    for (--num; num >= 0; num--) {
-        for (i = count; i != 0; i /= 2) {
-            if ((pfsMount->free_zone[bi->subpart] >= i) && (pfsBitmapAllocZones(pfsMount, bi, i) != 0)) {
-                pfsMount->free_zone[bi->subpart] -= bi->count;
-                pfsMount->zfree -= bi->count;
-                return 0;
-            }
-        }
-
-        bi->subpart++;
-        bi->number = 0;
-        if (pfsMount->num_subs - deleted == bi->subpart)
-            bi->subpart = 0;
-    }
-
-    return -ENOSPC;
-}
-
 // I hate this function. :(
 static int fsskMoveInode(pfs_mount_t *mount, pfs_cache_t *dest, pfs_cache_t *start, pfs_dentry_t *dentry)
 {
     pfs_cache_t *clink, *clink2, *clink3;
-    pfs_blockinfo_t block, block2;
+    pfs_blockinfo_t block, block2, *last;
     int result, i, value;
 
     printf("\t========== Move");
@@ -226,64 +392,62 @@ static int fsskMoveInode(pfs_mount_t *mount, pfs_cache_t *dest, pfs_cache_t *sta
     } else
         memcpy(&block, &dest->u.inode->inode_block, sizeof(pfs_blockinfo_t));
 
+    // The inode is placed at the start of a run that can hold the whole file, so that the data can follow it.
     block.count = 1;
-    if ((result = fsckBitmapSearchFreeZoneSpecial(mount, &block, start->u.inode->number_blocks, fsskRuntimeData.status.partsDeleted)) >= 0) {
+    if ((result = fsskBitmapSearchFreeExtent(mount, &block, start->u.inode->number_blocks, fsskRuntimeData.status.partsDeleted)) >= 0) {
         if ((result = fsskCopyBlock(mount, &block, &start->u.inode->inode_block, 1)) >= 0 &&
             (clink = pfsCacheGetData(mount, block.subpart, block.number << mount->inode_scale, PFS_CACHE_FLAG_SEGD | PFS_CACHE_FLAG_NOLOAD, &result)) != NULL) {
             memcpy(clink->u.inode, start->u.inode, sizeof(pfs_inode_t));
             memcpy(&clink->u.inode->inode_block, &block, sizeof(pfs_blockinfo_t));
             memcpy(&clink->u.inode->last_segment, &block, sizeof(pfs_blockinfo_t));
             memcpy(&clink->u.inode->data[0], &block, sizeof(pfs_blockinfo_t));
+            memset(&clink->u.inode->next_segment, 0, sizeof(pfs_blockinfo_t));
             clink->u.inode->number_segdesg = 1;
             clink->u.inode->number_data    = 1;
             clink->u.inode->number_blocks  = 1;
             clink2                         = pfsCacheUsedAdd(start);
             clink3                         = pfsCacheUsedAdd(clink);
 
+            // Non-SONY: each source segment is appended to the last segment where the zones after it are free.
+            // Only then is a new segment allocated, which may also take the following source segments.
             for (i = 1; i < start->u.inode->number_data && result == 0; i++) {
                 if (pfsFixIndex(i) == 0) {
                     if ((clink2 = pfsBlockGetNextSegment(clink2, &result)) == NULL)
                         break;
-                } else {
-                    memcpy(&block2, &clink2->u.inode->data[pfsFixIndex(i)], sizeof(pfs_blockinfo_t));
-                    if (pfsFixIndex(clink->u.inode->number_data - 1) != 0) {
-                        if ((value = pfsBitmapAllocateAdditionalZones(mount, clink3->u.inode->data, block2.count)) != 0) {
-                            block.subpart = clink3->u.inode->data[0].subpart;
-                            block.number  = clink3->u.inode->data[0].number + clink3->u.inode->data[0].count;
-                            clink3->u.inode->data[0].count += value;
-
-                            if ((result = fsskCopyBlock(mount, &block, &block2, value)) < 0)
-                                break;
+                    continue;
+                }
 
-                            clink->u.inode->number_blocks += value;
-                            block2.number += value;
-                            block2.count -= value;
-                        }
-                    }
-                    while (block2.count != 0) {
+                memcpy(&block2, &clink2->u.inode->data[pfsFixIndex(i)], sizeof(pfs_blockinfo_t));
+                while (block2.count != 0) {
+                    last = &clink3->u.inode->data[pfsFixIndex(clink->u.inode->number_data - 1)];
+                    if (pfsFixIndex(clink->u.inode->number_data - 1) != 0 && (value = pfsBitmapAllocateAdditionalZones(mount, last, block2.count)) != 0) {
+                        block.subpart = last->subpart;
+                        block.number  = last->number + last->count;
+                        last->count += value;
+                    } else {
                         if (pfsFixIndex(clink->u.inode->number_data) == 0) {
                             if ((clink3 = fsskCreateIndirectSeg(clink, clink3, clink3->u.inode->data, &result)) == NULL)
                                 break;
+                            last = clink3->u.inode->data;
                         }
 
-                        block.subpart = clink3->u.inode->data[0].subpart;
+                        block.subpart = last->subpart;
+                        block.number  = last->number + last->count;
                         block.count   = block2.count;
-                        block.number  = clink3->u.inode->data[0].number + clink3->u.inode->data[0].count;
-
-                        if ((result = fsckBitmapSearchFreeZoneSpecial(mount, &block, start->u.inode->number_blocks, fsskRuntimeData.status.partsDeleted)) < 0)
+                        if ((result = fsskBitmapSearchFreeExtent(mount, &block, block2.count, fsskRuntimeData.status.partsDeleted)) < 0)
                             break;
 
-                        memcpy(&clink3->u.inode->data[pfsFixIndex(start->u.inode->number_data)], &block, sizeof(pfs_blockinfo_t));
-
+                        memcpy(&clink3->u.inode->data[pfsFixIndex(clink->u.inode->number_data)], &block, sizeof(pfs_blockinfo_t));
                         clink->u.inode->number_data++;
-                        if ((result = fsskCopyBlock(mount, &block, &block2, block.count)) < 0)
-                            break;
-
-                        clink->u.inode->number_blocks += block.count;
-                        block2.number += block.count;
-                        block2.count -= block.count;
-                        block2.count--;
+                        value = block.count;
                     }
+
+                    if ((result = fsskCopyBlock(mount, &block, &block2, value)) < 0)
+                        break;
+
+                    clink->u.inode->number_blocks += value;
+                    block2.number += value;
+                    block2.count -= value;
                 }
             }
 
@@ -352,7 +516,7 @@ static int fsskCheckFile(pfs_cache_t *InodeClink, pfs_cache_t *DEntryClink, pfs_
                 if ((result = fsskMoveInode(InodeClink->pfsMount, InodeClink, FileInodeDataClink, dentry)) == 0) {
                     DEntryClink->flags |= PFS_CACHE_FLAG_DIRTY;
                     pfsCacheFree(FileInodeDataClink);
-                    FileInodeDataClink = pfsInodeGetData(InodeClink->pfsMount, dentry->inode, dentry->sub, &result);
+                    FileInodeDataClink = pfsInodeGetData(InodeClink->pfsMount, dentry->sub, dentry->inode, &result);
                 }
             }
 
@@ -554,6 +718,8 @@ static int FsskOpen(iop_file_t *fd, const char *name, int flags, int mode)
         return blockfd;
     }
 
+    pfsBitmapIndexReset(&MainPFSMount);
+    pfsDirIndexReset();
     memset(&MainPFSMount, 0, sizeof(MainPFSMount));
     MainPFSMount.fd       = blockfd;
     MainPFSMount.blockDev = pblockDevData;
@@ -563,6 +729,7 @@ static int FsskOpen(iop_file_t *fd, const char *name, int flags, int mode)
 
         fsskRuntimeData.status.zoneUsed = MainPFSMount.total_zones - MainPFSMount.zfree;
         fsskRuntimeData.minFree         = 3;
+        fsskTargetSize                  = 0;
         fd->privdata                    = &MainPFSMount;
         result                          = 0;
     } else {
@@ -575,8 +742,10 @@ static int FsskOpen(iop_file_t *fd, const char *name, int flags, int mode)
 
 static int FsskClose(iop_file_t *fd)
 {
+    pfsSaveFreeZones((pfs_mount_t *)fd->privdata);
+    pfsCacheClose((pfs_mount_t *)fd->privdata); // Non-SONY: before close(), so that the dirty buffers and the disk's write cache are still flushed to the partition.
+    pfsDirIndexReset(); // Non-SONY: dir.c is not linked into FSCK, so this cannot be done by pfsCacheClose().
     close(((pfs_mount_t *)fd->privdata)->fd);
-    pfsCacheClose((pfs_mount_t *)fd->privdata);
     memset(fd->privdata, 0, sizeof(pfs_mount_t));
 
     return 0;
@@ -625,6 +794,20 @@ static int fsskGetEstimatedTime(pfs_mount_t *mount, int *result)
     return 0;
 }
 
+static int fsskSetVerify(int verify)
+{
+    if (verify && fsskVerifyBuffer == NULL) {
+        if ((fsskVerifyBuffer = pfsAllocMem(fsskCopySectors * 512)) == NULL)
+            return -ENOMEM;
+    } else if (!verify && fsskVerifyBuffer != NULL) {
+        pfsFreeMem(fsskVerifyBuffer);
+        fsskVerifyBuffer = NULL;
+    }
+    fsskVerify = verify;
+
+    return 0;
+}
+
 static int FsskIoctl2(iop_file_t *fd, int cmd, void *arg, unsigned int arglen, void *buf, unsigned int buflen)
 {
     int result;
@@ -661,6 +844,13 @@ static int FsskIoctl2(iop_file_t *fd, int cmd, void *arg, unsigned int arglen, v
         case FSSK_IOCTL2_CMD_SIM:
             result = fsskSimGetStat(fd->privdata);
             break;
+        case FSSK_IOCTL2_CMD_SET_VERIFY:
+            result = (arglen >= sizeof(int)) ? fsskSetVerify(*(int *)arg != 0) : -EINVAL;
+            break;
+        case FSSK_IOCTL2_CMD_SET_TARGET_SIZE:
+            fsskTargetSize = (arglen >= sizeof(u32)) ? *(u32 *)arg : 0;
+            result         = 0;
+            break;
         default:
             result = 0;
     }
@@ -712,6 +902,7 @@ static int DisplayUsageHelp(void)
 
 int _start(int argc, char *argv[])
 {
+    u32 sectors;
     int buffers;
 
     buffers = 0x7E;
@@ -719,7 +910,8 @@ int _start(int argc, char *argv[])
         if (!strcmp("-n", *argv)) {
             argv++;
             if (--argc > 0) {
-                if (strtol(*argv, NULL, 10) < buffers)
+                // Non-SONY: the cache is no longer limited to 126 buffers.
+                if (strtol(*argv, NULL, 10) > 0 && strtol(*argv, NULL, 10) <= PFS_CACHE_MAX_BUFFERS)
                     buffers = strtol(*argv, NULL, 10);
             } else
                 return DisplayUsageHelp();
@@ -729,6 +921,8 @@ int _start(int argc, char *argv[])
 
     printf("fssk: max depth %d, %d buffers.\n", FSSK_MAX_PATH_LEVELS - 1, buffers);
 
+    Crc32Init();
+
     if (pfsCacheInit(buffers, 1024) < 0) {
         printf("fssk: error: cache initialization failed.\n");
         return MODULE_NO_RESIDENT_END;
@@ -740,6 +934,30 @@ int _start(int argc, char *argv[])
     if ((fsskThreadID = fsskCreateThread((void *)&FsskThread, 0x2080)) < 0)
         return MODULE_NO_RESIDENT_END;
 
+    // Non-SONY: copy in larger runs if there is memory for two larger buffers, after the cache.
+    for (sectors = FSSK_COPY_SIZE_MAX; sectors > IO_BUFFER_SIZE; sectors /= 2) {
+        if ((fsskCopyBuffers[0] = pfsAllocMem(sectors * 512)) != NULL) {
+            if ((fsskCopyBuffers[1] = pfsAllocMem(sectors * 512)) != NULL)
+                break;
+            pfsFreeMem(fsskCopyBuffers[0]);
+        }
+    }
+
+    // Otherwise, IOBuffer is used. Without the second buffer, copying falls back to reading and writing in turns.
+    if (sectors <= IO_BUFFER_SIZE) {
+        sectors            = IO_BUFFER_SIZE;
+        fsskCopyBuffers[0] = IOBuffer;
+        if ((fsskCopyBuffers[1] = pfsAllocMem(IO_BUFFER_SIZE_BYTES)) == NULL) {
+            printf("fssk: warning: no memory for a second copy buffer.\n");
+            fsskCopyBuffers[1] = IOBuffer;
+        }
+    }
+    fsskCopySectors = sectors;
+    printf("fssk: copy buffers of %lu sectors.\n", fsskCopySectors);
+
+    if (CopyInit("fssk", &fsskCopyIO) != 0)
+        return MODULE_NO_RESIDENT_END;
+
     DelDrv("fssk");
     if (AddDrv(&FsskDevice) == 0) {
         printf("fssk: version %04x driver start.\n", _irx_id.v);
@@ -559,16 +559,124 @@ static int CheckPartitions(int device, apa_cache_t *clink)
     return result;
 }
 
+// Digest of the partition table, recorded after a clean run. If nothing changed since, the repair passes can be skipped.
+#define HDCK_DIGEST_MAGIC 0x44434448 // 'HDCD'
+#define HDCK_MIN_PART_SIZE 0x40000 // 128MB, bounds the number of headers walked.
+
+struct HdckDigest
+{
+    u32 magic;
+    u32 generation; // Incremented on every update, used to seed the digest.
+    u32 count;      // Number of headers covered, including the MBR.
+    u32 digest;
+};
+
+static u32 HdckDigestAdd(u32 digest, u32 value)
+{
+    return apaHash(digest, &value, sizeof(value));
+}
+
+// Walks the chain without fixing anything, hashing the fields that describe it. Each header's checksum covers the rest of its contents.
+static int HdckCalcDigest(int device, apa_cache_t *clink, u32 generation, u32 limit, u32 *pCount, u32 *pDigest)
+{
+    apa_cache_t *clink2;
+    u32 digest, count, prev, sector;
+    int result;
+
+    digest = HdckDigestAdd(APA_HASH_INIT, generation);
+    prev   = clink->header->prev;
+    clink2 = clink;
+    clink->nused++;
+    result = 0;
+    for (count = 1; count <= limit; count++) {
+        if (clink2->header->prev != prev) {
+            result = -EIO;
+            break;
+        }
+
+        digest = HdckDigestAdd(digest, clink2->header->start);
+        digest = HdckDigestAdd(digest, clink2->header->length);
+        digest = HdckDigestAdd(digest, clink2->header->next);
+        digest = HdckDigestAdd(digest, clink2->header->prev);
+        digest = HdckDigestAdd(digest, clink2->header->checksum);
+
+        prev   = clink2->header->start;
+        sector = clink2->header->next;
+        apaCacheFree(clink2);
+        if (sector == 0) {
+            *pCount  = count;
+            *pDigest = digest;
+            return 0;
+        }
+
+        if ((clink2 = apaCacheGetHeader(device, sector, APA_IO_MODE_READ, &result)) == NULL)
+            return (result != 0 ? result : -EIO);
+    }
+
+    if (result == 0)
+        result = -EIO;
+    apaCacheFree(clink2);
+
+    return result;
+}
+
+// Reads the digest record and the sector error record in one go, then compares the record against the current chain.
+static int HdckCheckDigest(int device, apa_cache_t *clink, u32 *pGeneration)
+{
+    struct HdckDigest record;
+    u32 count, digest;
+
+    *pGeneration = 0;
+    if (ata_device_sector_io(device, IOBuffer, APA_SECTOR_HDCK_DIGEST, APA_SECTOR_PART_ERROR - APA_SECTOR_HDCK_DIGEST + 1, ATA_DIR_READ) != 0)
+        return -EIO;
+
+    memcpy(&record, IOBuffer, sizeof(record));
+    if (record.magic != HDCK_DIGEST_MAGIC)
+        return -ENOENT;
+    *pGeneration = record.generation;
+
+    // An I/O error was recorded since.
+    if (((u32 *)&IOBuffer[(APA_SECTOR_SECTOR_ERROR - APA_SECTOR_HDCK_DIGEST) * 512])[0] != 0)
+        return -EIO;
+
+    if (HdckCalcDigest(device, clink, record.generation, record.count, &count, &digest) != 0)
+        return -EINVAL;
+
+    return ((count == record.count && digest == record.digest) ? 0 : -EINVAL);
+}
+
+static void HdckSaveDigest(int device, apa_cache_t *clink, u32 generation)
+{
+    struct HdckDigest record;
+
+    record.magic      = HDCK_DIGEST_MAGIC;
+    record.generation = generation + 1;
+    if (HdckCalcDigest(device, clink, record.generation, PrivateData.HddInfo[device].sectors / HDCK_MIN_PART_SIZE + 1, &record.count, &record.digest) != 0)
+        return;
+
+    memset(IOBuffer, 0, 512);
+    memcpy(IOBuffer, &record, sizeof(record));
+    ata_device_sector_io(device, IOBuffer, APA_SECTOR_HDCK_DIGEST, 1, ATA_DIR_WRITE);
+    ata_device_flush_cache(device);
+}
+
 static int HdckDevctl(iop_file_t *fd, const char *name, int cmd, void *arg, unsigned int arglen, void *buf, unsigned int buflen)
 {
     int result, badParts;
     apa_cache_t *clink;
+    u32 generation;
 
     if (PrivateData.HddInfo[fd->unit].status != 0) {
         return -ENXIO;
     }
 
     if ((clink = apaCacheGetHeader(fd->unit, APA_SECTOR_MBR, 0, &result)) != NULL) {
+        if (HdckCheckDigest(fd->unit, clink, &generation) == 0) {
+            printf("hdck: partition table unchanged since the last check.\n");
+            result = 0;
+            goto check_end;
+        }
+
         badParts = 0;
         while (CheckAPAPartitionLinks(fd->unit, clink) != 0) {
             // Both pointers point to the same partition.
@@ -620,6 +728,8 @@ static int HdckDevctl(iop_file_t *fd, const char *name, int cmd, void *arg, unsi
         EraseSector(fd->unit, IOBuffer, APA_SECTOR_SECTOR_ERROR); // Erase the error sector record.
         DeleteFreePartitions(fd->unit, clink);
         result = CheckPartitions(fd->unit, clink);
+        if (result == 0)
+            HdckSaveDigest(fd->unit, clink, generation);
 
     check_end:
         apaCacheFree(clink);
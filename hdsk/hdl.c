@@ -45,10 +45,100 @@ typedef struct // size = 1024 bytes
     part_specs_t part_specs[65];
 } hdl_game_info_t;
 
-extern u8 IOBuffer[IOBUFFER_SIZE_SECTORS * 512];
+// Non-SONY: the information of the games being moved is kept, so that it is written once for all slices that were moved together.
+// Each move of a block changes the slices of at most one game, so a block never needs more entries than it has moves.
+#define HDL_INFO_CACHE_SIZE HDSK_BLOCK_MAX_MOVES
+
+struct hdlInfoCache
+{
+    int device;
+    u32 lba; // 0 if unused.
+    int dirty;
+    hdl_game_info_t info;
+};
+
+static struct hdlInfoCache hdlInfoCache[HDL_INFO_CACHE_SIZE];
+static unsigned int hdlInfoCacheNext;
+static int hdlBatch;
+static unsigned int hdlBatchEvictions; // Games that were written before the end of the batch, to make room for another.
+
+static int hdlWriteGameInfo(struct hdlInfoCache *entry)
+{
+    int result;
+
+    result = 0;
+    if (entry->dirty) {
+        entry->dirty = 0;
+        result       = ata_device_sector_io(entry->device, &entry->info, entry->lba, sizeof(hdl_game_info_t) / 512, ATA_DIR_WRITE);
+    }
+
+    return result;
+}
+
+static struct hdlInfoCache *hdlGetGameInfo(int device, u32 InfoLBA, int *result)
+{
+    struct hdlInfoCache *entry;
+    int i;
+
+    for (i = 0; i < HDL_INFO_CACHE_SIZE; i++) {
+        if (hdlInfoCache[i].lba == InfoLBA && hdlInfoCache[i].device == device)
+            return &hdlInfoCache[i];
+    }
+
+    entry            = &hdlInfoCache[hdlInfoCacheNext];
+    hdlInfoCacheNext = (hdlInfoCacheNext + 1) % HDL_INFO_CACHE_SIZE;
+    if (hdlBatch && entry->dirty)
+        hdlBatchEvictions++;
+    if ((*result = hdlWriteGameInfo(entry)) != 0)
+        return NULL;
+
+    entry->lba = 0;
+    if ((*result = ata_device_sector_io(device, &entry->info, InfoLBA, sizeof(hdl_game_info_t) / 512, ATA_DIR_READ)) != 0)
+        return NULL;
+    if (entry->info.magic != HDL_INFO_MAGIC) {
+        *result = -1;
+        return NULL;
+    }
+
+    entry->device = device;
+    entry->lba    = InfoLBA;
+
+    return entry;
+}
+
+// Until hdlEndBatch() is called, updates are only written by hdlFlushGameSliceInfo().
+void hdlBeginBatch(void)
+{
+    hdlBatch          = 1;
+    hdlBatchEvictions = 0;
+}
+
+int hdlFlushGameSliceInfo(void)
+{
+    int result, i;
+
+    result = 0;
+    for (i = 0; i < HDL_INFO_CACHE_SIZE; i++) {
+        if (hdlWriteGameInfo(&hdlInfoCache[i]) != 0)
+            result = -EIO;
+        hdlInfoCache[i].lba = 0; // The partition may be moved, with its data.
+    }
+
+    return result;
+}
+
+int hdlEndBatch(void)
+{
+    hdlBatch = 0;
+    if (hdlBatchEvictions != 0)
+        printf("hdl: %u games were written more than once in a batch.\n", hdlBatchEvictions);
+
+    return hdlFlushGameSliceInfo();
+}
 
 int hdlUpdateGameSliceInfo(int device, u32 main, int part, u32 OldPartStart, u32 NewPartStart)
 {
+    struct hdlInfoCache *entry;
     u32 InfoLBA, DataOffset;
     int result;
 
@@ -56,13 +146,16 @@ int hdlUpdateGameSliceInfo(int device, u32 main, int part, u32 OldPartStart, u32
             before the extended attribute area. */
     InfoLBA = main + (HDL_GAME_DATA_OFFSET + 4096) / 512;
 
-    if ((result = ata_device_sector_io(device, IOBuffer, InfoLBA, sizeof(hdl_game_info_t) / 512, ATA_DIR_READ)) == 0) {
-        if (((hdl_game_info_t *)IOBuffer)->magic == HDL_INFO_MAGIC) {
-            DataOffset                                                 = ((hdl_game_info_t *)IOBuffer)->part_specs[part].data_start - OldPartStart;
-            ((hdl_game_info_t *)IOBuffer)->part_specs[part].data_start = NewPartStart + DataOffset;
-            result                                                     = ata_device_sector_io(device, IOBuffer, InfoLBA, sizeof(hdl_game_info_t) / 512, ATA_DIR_WRITE);
-        } else
-            result = -1;
+    result = 0; // A cached entry is returned without setting result.
+    if ((entry = hdlGetGameInfo(device, InfoLBA, &result)) != NULL) {
+        if (part < 0 || part >= 65)
+            return -EINVAL;
+
+        DataOffset                              = entry->info.part_specs[part].data_start - OldPartStart;
+        entry->info.part_specs[part].data_start = NewPartStart + DataOffset;
+        entry->dirty                            = 1;
+        if (!hdlBatch)
+            result = hdlFlushGameSliceInfo();
     }
 
     return result;
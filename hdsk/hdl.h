@@ -1,3 +1,6 @@
 #define APA_TYPE_HDLFS 0x1337
 
 int hdlUpdateGameSliceInfo(int device, u32 main, int part, u32 OldPartStart, u32 NewPartStart);
+void hdlBeginBatch(void);
+int hdlFlushGameSliceInfo(void);
+int hdlEndBatch(void);
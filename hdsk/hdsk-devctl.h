@@ -7,6 +7,10 @@ enum HDSK_DEVCTL {
     HDSK_DEVCTL_GET_STATUS,
     HDSK_DEVCTL_STOP,
     HDSK_DEVCTL_GET_PROGRESS,
+    HDSK_DEVCTL_SET_TRANSFER_SIZE, // Non-SONY: sectors to copy per I/O request. A power of 2, from 256 to 65536.
+    HDSK_DEVCTL_GET_ESTIMATE,      // Non-SONY: like HDSK_DEVCTL_GET_HDD_STAT, but returns struct hdskEstimate.
+    HDSK_DEVCTL_SET_VERIFY,        // Non-SONY: input = u32, non-zero to read back and check every block that is copied.
+    HDSK_DEVCTL_RESCAN,            // Non-SONY: read the partition table again, after HDD.IRX has changed it.
 };
 
 struct hdskStat
@@ -14,3 +18,14 @@ struct hdskStat
     u32 free;
     u32 total;
 };
+
+// Non-SONY: the cost of the planned moves.
+struct hdskEstimate
+{
+    u32 free;    // Installable space after the moves.
+    u32 total;   // Sectors to copy, which is what HDSK_DEVCTL_GET_PROGRESS counts up to.
+    u32 headers; // APA headers to rewrite.
+    u32 moves;   // Partitions or blocks of partitions to move.
+    u32 rate;    // Measured copy throughput, in sectors per second.
+    u32 seconds; // Estimated time for the copies.
+};
@@ -13,6 +13,9 @@
 
 #include "apa-opt.h"
 #include "libapa.h"
+#include "libpfs.h"
+#include "crc32.h"
+#include "copy.h"
 #include "hdsk-devctl.h"
 #include "hdsk.h"
 #include "sim.h"
@@ -33,18 +36,70 @@ static int hdskThreadID;    // 0x000276cc
 static int hdskStopFlag;
 static int hdskStatus;
 static u32 hdskProgress;
+static int hdskBusy;
 
 u8 IOBuffer[IOBUFFER_SIZE_SECTORS * 512];
 
+// Copying is pipelined through the writer thread in common/copy.
+static u8 *hdskCopyBuffers[HDSK_COPY_BUFFERS];
+static u32 hdskCopySectors;
+static u32 hdskCopyRate;           // Measured copy rate for hdskCopySectors, in sectors/second. 0 if not measured yet.
+static int hdskCopyPending;        // A write is still in progress, which may be left over from the previous partition.
+static u32 hdskCopyNext;           // Buffer to read the next block into.
+static apa_cache_t *hdskBatch[HDSK_BATCH_HEADERS]; // Rewritten headers that are waiting to be committed.
+static u32 hdskBatchCount;
+static int hdskVerify;         // Non-SONY: read back every block after it is written.
+static u8 *hdskVerifyBuffer;
+
+// Non-SONY: PFS partitions are copied sparsely, by skipping the zones that are free in their zone bitmaps.
+struct hdskPfsBitmap
+{
+    u32 lba;       // First sector of the bitmap.
+    u32 zoneScale; // log2 of the zone size, in sectors.
+    u32 sector;    // Bitmap sector that is loaded in words.
+    u32 words[128];
+};
+
+static struct hdskPfsBitmap hdskPfsBitmap;
+
+// Non-SONY: the progress of the copy is recorded periodically, so that an interrupted move can be resumed.
+#define HDSK_JOURNAL_MAGIC    0x4B534448 // 'HDSK'
+#define HDSK_JOURNAL_INTERVAL 0x8000     // Sectors copied between updates (16MB).
+
+struct hdskMoveJournal
+{
+    u32 magic;
+    u32 src;
+    u32 dest;
+    u32 length;
+    u32 offset;      // Sectors from the start of the partition that were copied. They are compared with the source before resuming.
+    u32 fingerprint; // Of the source, to detect changes that were made to it in the meantime.
+    u32 checksum;
+};
+
+static u32 hdskJournalSector[128];
+
+#define HDSK_PLAN_CANDIDATES  4    // Sources that the search considers for each empty partition.
+#define HDSK_PLAN_EVALUATIONS 48   // Plans that the search simulates, in addition to the two greedy ones.
+#define HDSK_PLAN_HEADER_COST 0x800 // A header rewrite costs a journal write and cache flushes, taken to be as long as copying 1MB.
+
+static struct hdskPlan hdskPlans[2]; // The best plan so far, and the plan being tried.
+static struct hdskPlan *hdskPlan;    // The plan that HdskThread will carry out.
+static u8 hdskPlanChoices[HDSK_PLAN_MAX_MOVES];
+
 #define HDSK_MIN_PART_SIZE 0x00040000
 
-static int hdskRemoveTmp(int device)
+#define HDSK_RATE_SAMPLE_SECTORS 0x8000 // Read 16MB to measure the throughput.
+
+static int hdskRemoveTmpPartition(int device, int *found)
 {
     apa_cache_t *clink, *clinkSub;
     char partition[APA_IDMAX];
     u32 start;
     int result, sub;
 
+    *found = 0;
+
     clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &result);
     memset(partition, 0, sizeof(partition));
     strcpy(partition, "_tmp");
@@ -59,6 +114,7 @@ static int hdskRemoveTmp(int device)
     }
 
     if (result == 0 && clink != NULL) {
+        *found = 1;
         printf("hdsk: remove _tmp\n");
         sub                 = clink->header->nsub;
         clink->header->nsub = 0;
@@ -84,12 +140,30 @@ static int hdskRemoveTmp(int device)
     return result;
 }
 
+// Non-SONY: an interrupted block move can leave the old locations of up to HDSK_BLOCK_MAX_MOVES partitions as _tmp.
+static int hdskRemoveTmp(int device)
+{
+    int result, found;
+
+    while ((result = hdskRemoveTmpPartition(device, &found)) == 0 && found)
+        ;
+
+    return result;
+}
+
 static apa_cache_t *hdskFindEmptyPartition(int device, u32 size)
 {
     int result;
     apa_cache_t *clink;
+    const apa_index_entry_t *entry;
+
+    if (apaIndexIsValid(device)) {
+        clink = NULL;
+        if ((entry = apaIndexFindFree(device, size)) != NULL)
+            clink = apaCacheGetHeader(device, entry->start, APA_IO_MODE_READ, &result);
+    } else
+        clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &result);
 
-    clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &result);
     while (clink != NULL) {
         if (clink->header->length != size || clink->header->type != APA_TYPE_FREE) {
             clink = apaGetNextHeader(clink, &result);
@@ -248,53 +322,358 @@ static apa_cache_t *hdskFindLastUsedBlock(int device, u32 MinSize, u32 start, in
     return last;
 }
 
-static int CopyPartition(int device, apa_header_t *dest, apa_header_t *start)
+// Disk access for the copy writer thread. unit is the device.
+static int hdskCopyIO(void *device, void *buffer, u32 unit, u32 sector, u32 count, int write)
+{
+    return ata_device_sector_io(unit, buffer, sector, count, write ? ATA_DIR_WRITE : ATA_DIR_READ) == 0 ? 0 : -EIO;
+}
+
+// Waits for the last block of the copy to be written.
+static int hdskCopyDrain(void)
 {
-    u32 blocks, i;
     int result;
 
-    blocks = dest->length / IOBUFFER_SIZE_SECTORS;
-    printf("hdsk: copy start...");
+    result = 0;
+    if (hdskCopyPending) {
+        hdskCopyPending = 0;
+        if ((result = CopyWaitWrite()) == 0)
+            hdskProgress += hdskCopySectors;
+    }
 
-    // Copy data, but skip the APA header.
-    result = ata_device_sector_io(device, IOBuffer, start->start + 2, IOBUFFER_SIZE_SECTORS - 2, ATA_DIR_READ) == 0 ? 0 : -EIO;
+    return result;
+}
 
-    if (result == 0) {
-        result = ata_device_sector_io(device, IOBuffer, dest->start + 2, IOBUFFER_SIZE_SECTORS - 2, ATA_DIR_WRITE) == 0 ? 0 : -EIO;
+static int hdskSetTransferSize(u32 sectors)
+{
+    u8 *buffers[HDSK_COPY_BUFFERS], *verify;
+    int i;
 
-        if (result == 0) {
-            hdskProgress += IOBUFFER_SIZE_SECTORS;
+    // Blocks must divide the smallest partition.
+    if (sectors < IOBUFFER_SIZE_SECTORS || sectors > HDSK_MAX_TRANSFER_SECTORS || (sectors & (sectors - 1)) != 0)
+        return -EINVAL;
+    if (hdskBusy)
+        return -EBUSY;
+
+    // The default size uses IOBuffer as the first buffer.
+    for (i = 0; i < HDSK_COPY_BUFFERS; i++) {
+        buffers[i] = (i == 0 && sectors == IOBUFFER_SIZE_SECTORS) ? IOBuffer : AllocMemory(sectors * 512);
+        if (buffers[i] == NULL) {
+            for (--i; i >= 0; i--) {
+                if (buffers[i] != IOBuffer)
+                    FreeMemory(buffers[i]);
+            }
+            return -ENOMEM;
+        }
+    }
 
-            for (i = 1; i < blocks; i++) {
-                result = ata_device_sector_io(device, IOBuffer, start->start + i * IOBUFFER_SIZE_SECTORS, IOBUFFER_SIZE_SECTORS, ATA_DIR_READ) == 0 ? 0 : -EIO;
+    verify = NULL;
+    if (hdskVerify && (verify = AllocMemory(sectors * 512)) == NULL) {
+        for (i = 0; i < HDSK_COPY_BUFFERS; i++) {
+            if (buffers[i] != IOBuffer)
+                FreeMemory(buffers[i]);
+        }
+        return -ENOMEM;
+    }
 
-                if (result == 0) {
-                    result = ata_device_sector_io(device, IOBuffer, dest->start + i * IOBUFFER_SIZE_SECTORS, IOBUFFER_SIZE_SECTORS, ATA_DIR_WRITE) == 0 ? 0 : -EIO;
+    if (hdskVerifyBuffer != NULL)
+        FreeMemory(hdskVerifyBuffer);
+    hdskVerifyBuffer = verify;
 
-                    if (result == 0) {
-                        hdskProgress += IOBUFFER_SIZE_SECTORS;
-                        if (hdskStopFlag)
-                            break;
-                    } else {
-                        printf("hdsk: error: write failed at %08lx.\n", dest->start + i * IOBUFFER_SIZE_SECTORS);
-                        break;
-                    }
-                } else {
-                    printf("hdsk: error: read failed at %08lx.\n", start->start + i * IOBUFFER_SIZE_SECTORS);
-                    break;
-                }
+    for (i = 0; i < HDSK_COPY_BUFFERS; i++) {
+        if (hdskCopyBuffers[i] != NULL && hdskCopyBuffers[i] != IOBuffer)
+            FreeMemory(hdskCopyBuffers[i]);
+        hdskCopyBuffers[i] = buffers[i];
+    }
+    hdskCopySectors = sectors;
+    hdskCopyRate    = 0;
+
+    printf("hdsk: transfer size %08lx sectors.\n", sectors);
+
+    return 0;
+}
+
+static int hdskSetVerify(int verify)
+{
+    if (hdskBusy)
+        return -EBUSY;
+
+    if (verify && hdskVerifyBuffer == NULL) {
+        if ((hdskVerifyBuffer = AllocMemory(hdskCopySectors * 512)) == NULL)
+            return -ENOMEM;
+    } else if (!verify && hdskVerifyBuffer != NULL) {
+        FreeMemory(hdskVerifyBuffer);
+        hdskVerifyBuffer = NULL;
+    }
+    hdskVerify = verify;
+
+    printf("hdsk: verify %s.\n", verify ? "on" : "off");
+
+    return 0;
+}
+
+static int hdskPfsBitmapInit(int device, const apa_header_t *start)
+{
+    pfs_super_block_t *super;
+    u32 scale;
+
+    if (start->type != APA_TYPE_PFS)
+        return -EINVAL;
+
+    // The superblock is only found in the main partition.
+    if (ata_device_sector_io(device, hdskPfsBitmap.words, ((start->flags & APA_FLAG_SUB) ? start->main : start->start) + PFS_SUPER_SECTOR, 1, ATA_DIR_READ) != 0)
+        return -EIO;
+
+    super = (pfs_super_block_t *)hdskPfsBitmap.words;
+    if (super->magic != PFS_SUPER_MAGIC || super->version > PFS_FORMAT_VERSION || (super->pfsFsckStat & PFS_FSCK_STAT_WRITE_ERROR))
+        return -EINVAL;
+    if (super->zone_size < 2048 || super->zone_size > 131072 || (super->zone_size & (super->zone_size - 1)) != 0)
+        return -EINVAL;
+
+    for (scale = 0; (512 << scale) < super->zone_size; scale++)
+        ;
+
+    // The bitmap starts from the 2nd zone. In the main partition, the first 4MB are reserved.
+    hdskPfsBitmap.zoneScale = scale;
+    hdskPfsBitmap.lba       = start->start + (1 << scale) + ((start->flags & APA_FLAG_SUB) ? 0 : 0x2000);
+    hdskPfsBitmap.sector    = 0xFFFFFFFF;
+
+    return 0;
+}
+
+// Returns the range of used zones within count zones from zone. If the bitmap cannot be read, all zones are reported as used.
+static int hdskPfsGetUsedZones(int device, u32 zone, u32 count, u32 *first, u32 *last)
+{
+    u32 end;
+    int found;
+
+    found = 0;
+    for (end = zone + count; zone < end; zone++) {
+        if ((zone >> 12) != hdskPfsBitmap.sector) {
+            if (ata_device_sector_io(device, hdskPfsBitmap.words, hdskPfsBitmap.lba + (zone >> 12), 1, ATA_DIR_READ) != 0) {
+                hdskPfsBitmap.sector = 0xFFFFFFFF;
+                *first               = end - count;
+                *last                = end - 1;
+                return 1;
+            }
+
+            hdskPfsBitmap.sector = zone >> 12;
+        }
+
+        if ((zone & 31) == 0 && hdskPfsBitmap.words[(zone >> 5) & 127] == 0) {
+            zone += 31;
+            continue;
+        }
+
+        if (hdskPfsBitmap.words[(zone >> 5) & 127] & (1 << (zone & 31))) {
+            if (!found)
+                *first = zone;
+            *last = zone;
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+static u32 hdskJournalChecksum(const struct hdskMoveJournal *journal)
+{
+    return apaHash(APA_HASH_INIT, journal, sizeof(struct hdskMoveJournal) - sizeof(u32)); // All but the checksum.
+}
+
+static int hdskJournalRead(int device, struct hdskMoveJournal *journal)
+{
+    if (ata_device_sector_io(device, hdskJournalSector, APA_SECTOR_HDSK_JOURNAL, 1, ATA_DIR_READ) != 0)
+        return -EIO;
+
+    memcpy(journal, hdskJournalSector, sizeof(struct hdskMoveJournal));
+    if (journal->magic != HDSK_JOURNAL_MAGIC || journal->checksum != hdskJournalChecksum(journal))
+        return -ENOENT;
+
+    return 0;
+}
+
+// Records the progress of the copy. The copied data must reach the disk before the record does.
+static void hdskJournalWrite(int device, struct hdskMoveJournal *journal)
+{
+    memset(hdskJournalSector, 0, sizeof(hdskJournalSector));
+    if (journal != NULL) {
+        journal->magic    = HDSK_JOURNAL_MAGIC;
+        journal->checksum = hdskJournalChecksum(journal);
+        memcpy(hdskJournalSector, journal, sizeof(struct hdskMoveJournal));
+    }
+
+    ata_device_flush_cache(device);
+    ata_device_sector_io(device, hdskJournalSector, APA_SECTOR_HDSK_JOURNAL, 1, ATA_DIR_WRITE);
+    ata_device_flush_cache(device);
+}
+
+// Covers the header of the source and, for PFS, the superblock and the log. Every PFS write session updates the log.
+static int hdskGetFingerprint(int device, const apa_header_t *start, u32 *fingerprint)
+{
+    pfs_super_block_t *super;
+    u32 main, scale, sector, sectors, hash;
+    u32 *words;
+
+    hash = apaHash(APA_HASH_INIT, &start->checksum, sizeof(start->checksum));
+    if (start->type == APA_TYPE_PFS) {
+        main  = (start->flags & APA_FLAG_SUB) ? start->main : start->start;
+        words = (u32 *)hdskCopyBuffers[hdskCopyNext % HDSK_COPY_BUFFERS]; // Not being written.
+        if (ata_device_sector_io(device, words, main + PFS_SUPER_SECTOR, 1, ATA_DIR_READ) != 0)
+            return -EIO;
+
+        hash = apaHash(hash, words, 512);
+
+        super = (pfs_super_block_t *)words;
+        if (super->magic == PFS_SUPER_MAGIC && super->zone_size >= 512 && super->zone_size <= 131072) {
+            for (scale = 0; (512 << scale) < super->zone_size; scale++)
+                ;
+
+            sector  = main + (super->log.number << scale);
+            sectors = super->log.count << scale;
+            if (sectors > hdskCopySectors)
+                sectors = hdskCopySectors;
+
+            if (ata_device_sector_io(device, words, sector, sectors, ATA_DIR_READ) != 0)
+                return -EIO;
+
+            hash = apaHash(hash, words, sectors * 512);
+        }
+    }
+
+    *fingerprint = hash;
+
+    return 0;
+}
+
+// Returns the part of the block to copy in skip and sectors, or 0 if the block has no data to copy.
+static int hdskCopyGetSpan(int device, u32 block, int sparse, u32 *skip, u32 *sectors)
+{
+    u32 zones, first, last;
+
+    *skip    = (block == 0) ? 2 : 0; // Copy data, but skip the APA header.
+    *sectors = hdskCopySectors;
+
+    if (sparse) {
+        zones = hdskCopySectors >> hdskPfsBitmap.zoneScale;
+        if (!hdskPfsGetUsedZones(device, block * zones, zones, &first, &last))
+            return 0;
+
+        // Only copy the sectors from the first to the last used zone.
+        first = (first - block * zones) << hdskPfsBitmap.zoneScale;
+        if (first > *skip)
+            *skip = first;
+        *sectors = (last - block * zones + 1) << hdskPfsBitmap.zoneScale;
+    }
+
+    return 1;
+}
+
+// Returns the number of blocks, up to count, that are the same on the source and the destination.
+// The journal only records how far the copy went, so everything before that is compared again before it is skipped.
+static u32 hdskCopyCompare(int device, const apa_header_t *dest, const apa_header_t *start, int sparse, u32 count)
+{
+    u32 i, skip, sectors;
+
+    for (i = 0; i < count && hdskStopFlag == 0; i++) {
+        if (!hdskCopyGetSpan(device, i, sparse, &skip, &sectors))
+            continue;
+
+        if (ata_device_sector_io(device, hdskCopyBuffers[0], start->start + i * hdskCopySectors + skip, sectors - skip, ATA_DIR_READ) != 0 ||
+            ata_device_sector_io(device, hdskCopyBuffers[1], dest->start + i * hdskCopySectors + skip, sectors - skip, ATA_DIR_READ) != 0 ||
+            memcmp(hdskCopyBuffers[0], hdskCopyBuffers[1], (sectors - skip) * 512) != 0)
+            break;
+    }
+
+    return i;
+}
+
+static int CopyPartition(int device, apa_header_t *dest, apa_header_t *start)
+{
+    struct hdskMoveJournal journal;
+    u32 blocks, i, skip, sectors, checkpoint, fingerprint, crc;
+    int result, sparse, journalled;
+    u8 *buffer;
+
+    if (hdskCopyPending)
+        return -EBUSY;
+
+    blocks     = dest->length / hdskCopySectors;
+    journalled = hdskGetFingerprint(device, start, &fingerprint) == 0;
+    sparse     = hdskPfsBitmapInit(device, start) == 0;
+
+    // Resume the copy if it was interrupted. The blocks that were recorded as copied are only skipped while they match the source.
+    i = 0;
+    if (journalled && hdskJournalRead(device, &journal) == 0 && journal.src == start->start && journal.dest == dest->start && journal.length == dest->length && journal.fingerprint == fingerprint) {
+        checkpoint = journal.offset / hdskCopySectors;
+        if ((i = hdskCopyCompare(device, dest, start, sparse, checkpoint)) < checkpoint)
+            printf("hdsk: destination differs at %08lx, copy again from there.\n", i * hdskCopySectors);
+        else
+            printf("hdsk: resume copy from %08lx.\n", i * hdskCopySectors);
+        hdskProgress += i * hdskCopySectors;
+    }
+
+    journal.src         = start->start;
+    journal.dest        = dest->start;
+    journal.length      = dest->length;
+    journal.fingerprint = fingerprint;
+    checkpoint          = i;
+
+    printf("hdsk: copy start%s...", sparse ? " (sparse)" : "");
+
+    // Reading a block overlaps with writing the previous one. The write of another partition must not be pending.
+    // The last write is left to complete in the background: the caller waits for it with hdskCopyDrain().
+    result = 0;
+    for (; i < blocks; i++) {
+        if (!hdskCopyGetSpan(device, i, sparse, &skip, &sectors)) {
+            hdskProgress += hdskCopySectors;
+            if (hdskStopFlag)
+                break;
+            continue;
+        }
+
+        buffer = hdskCopyBuffers[hdskCopyNext % HDSK_COPY_BUFFERS];
+        hdskCopyNext++;
+
+        if ((result = ata_device_sector_io(device, buffer, start->start + i * hdskCopySectors + skip, sectors - skip, ATA_DIR_READ) == 0 ? 0 : -EIO) != 0) {
+            printf("hdsk: error: read failed at %08lx.\n", start->start + i * hdskCopySectors);
+            break;
+        }
+
+        // While the previous block is being written and read back.
+        crc = hdskVerify ? Crc32(0, buffer, (sectors - skip) * 512) : 0;
+
+        if (hdskCopyPending) {
+            hdskCopyPending = 0;
+            if ((result = CopyWaitWrite()) != 0)
+                break;
+
+            // All blocks before this one were written.
+            if (journalled && (i - checkpoint) * hdskCopySectors >= HDSK_JOURNAL_INTERVAL) {
+                journal.offset = i * hdskCopySectors;
+                hdskJournalWrite(device, &journal);
+                checkpoint = i;
             }
 
-            printf("done\n");
+            hdskProgress += hdskCopySectors;
+            if (hdskStopFlag)
+                break;
         }
+
+        CopyPostWrite(NULL, buffer, device, dest->start + i * hdskCopySectors + skip, sectors - skip, hdskVerify ? hdskVerifyBuffer : NULL, crc);
+        hdskCopyPending = 1;
     }
 
+    if (result == 0)
+        printf("done\n");
+    else
+        hdskCopyDrain();
+
     return result;
 }
 
-static int SwapPartition(int device, apa_cache_t *dest, apa_cache_t *start)
+// Rewrites the headers in the cache. The related headers that were changed are returned in clink and have to be freed by the caller.
+static int hdskSwapHeaders(int device, apa_cache_t *dest, apa_cache_t *start, apa_cache_t **clink)
 {
-    apa_cache_t *clink[64];
     int result, i;
     u32 StartSector, next, prev;
 
@@ -302,8 +681,6 @@ static int SwapPartition(int device, apa_cache_t *dest, apa_cache_t *start)
     next        = dest->header->next;
     prev        = dest->header->prev;
 
-    printf("hdsk: swap %s partition start...", (start->header->flags & APA_FLAG_SUB) ? "sub" : "main");
-
     memcpy(dest->header, start->header, sizeof(apa_header_t));
     dest->header->start = StartSector;
     dest->header->next  = next;
@@ -322,7 +699,7 @@ static int SwapPartition(int device, apa_cache_t *dest, apa_cache_t *start)
     start->header->type   = dest->header->type;
     strcpy(start->header->id, "_tmp");
 
-    memset(clink, 0, sizeof(clink));
+    memset(clink, 0, 64 * sizeof(apa_cache_t *));
     if (dest->header->flags & APA_FLAG_SUB) {
         if ((clink[0] = apaCacheGetHeader(device, dest->header->main, APA_IO_MODE_READ, &result)) != NULL) {
             for (i = 0; i < clink[0]->header->nsub; i++) {
@@ -367,6 +744,20 @@ static int SwapPartition(int device, apa_cache_t *dest, apa_cache_t *start)
 
     dest->flags |= APA_CACHE_FLAG_DIRTY;
     start->flags |= APA_CACHE_FLAG_DIRTY;
+
+    return result;
+}
+
+static int SwapPartition(int device, apa_cache_t *dest, apa_cache_t *start)
+{
+    apa_cache_t *clink[64];
+    int result, i;
+
+    printf("hdsk: swap %s partition start...", (start->header->flags & APA_FLAG_SUB) ? "sub" : "main");
+
+    if ((result = hdskSwapHeaders(device, dest, start, clink)) != 0)
+        return result;
+
     apaCacheFlushAllDirty(device);
     for (i = 0; i < 64; i++) {
         if (clink[i] != NULL)
@@ -378,6 +769,27 @@ static int SwapPartition(int device, apa_cache_t *dest, apa_cache_t *start)
     return result;
 }
 
+// Commits the headers that were rewritten for a block move in one journal transaction.
+static void hdskBatchCommit(int device)
+{
+    u32 i;
+
+    if (hdskBatchCount == 0)
+        return;
+
+#ifdef HDSK_SUPPORT_HDLFS
+    // Like SwapPartition, the slice information is written before the headers.
+    hdlFlushGameSliceInfo();
+#endif
+    apaCacheFlushAllDirty(device);
+    for (i = 0; i < hdskBatchCount; i++)
+        apaCacheFree(hdskBatch[i]);
+    hdskBatchCount = 0;
+
+    // The copies are complete.
+    hdskJournalWrite(device, NULL);
+}
+
 static int MovePartition(int device, apa_cache_t *dest, apa_cache_t *start)
 {
     int result;
@@ -395,9 +807,11 @@ static int MovePartition(int device, apa_cache_t *dest, apa_cache_t *start)
     }
 
     if ((result = hdskRemoveTmp(device)) == 0) {
-        if ((result = CopyPartition(device, dest->header, start->header)) == 0) {
-            if (hdskStopFlag == 0)
+        if ((result = CopyPartition(device, dest->header, start->header)) == 0 && (result = hdskCopyDrain()) == 0) {
+            if (hdskStopFlag == 0) {
                 SwapPartition(device, dest, start);
+                hdskJournalWrite(device, NULL);
+            }
         }
     }
 
@@ -413,6 +827,8 @@ static int SplitEmptyPartition(int device, apa_cache_t *partition, u32 length)
 
     printf("hdsk: split empty partition.\n");
 
+    result = 0;
+
     while (partition->header->length != length) {
         if ((empty = apaCacheGetHeader(device, partition->header->next, APA_IO_MODE_READ, &result)) != NULL) {
             partition->header->length /= 2;
@@ -432,39 +848,208 @@ static int SplitEmptyPartition(int device, apa_cache_t *partition, u32 length)
     return result;
 }
 
+// Swaps the headers of the partitions that were copied. Main partitions are done first, so that the HDL slice information is
+// updated in the main partition's new location. The headers are committed together, unless they do not fit into the journal.
+static int hdskSwapBlock(int device, const struct hdskMove *moves, u32 count, u32 *swapped)
+{
+    apa_cache_t *clink[64], *dest, *start;
+    u32 i, needed;
+    int result, pass, j;
+
+    result = 0;
+#ifdef HDSK_SUPPORT_HDLFS
+    hdlBeginBatch();
+#endif
+    for (pass = 0; pass < 2 && result == 0; pass++) {
+        for (i = 0; i < count; i++) {
+            dest  = apaCacheGetHeader(device, moves[i].dest, APA_IO_MODE_READ, &result);
+            start = apaCacheGetHeader(device, moves[i].src, APA_IO_MODE_READ, &result);
+            if (dest == NULL || start == NULL) {
+                if (dest != NULL)
+                    apaCacheFree(dest);
+                if (start != NULL)
+                    apaCacheFree(start);
+                if (result == 0)
+                    result = -EIO;
+                break;
+            }
+
+            if ((start->header->flags & APA_FLAG_SUB) ? pass == 0 : pass != 0) {
+                apaCacheFree(dest);
+                apaCacheFree(start);
+                continue;
+            }
+
+            needed = 2 + ((start->header->flags & APA_FLAG_SUB) ? 1 : start->header->nsub);
+            if (hdskBatchCount + needed > HDSK_BATCH_HEADERS)
+                hdskBatchCommit(device);
+
+            if ((result = hdskSwapHeaders(device, dest, start, clink)) != 0) {
+                apaCacheFree(dest);
+                apaCacheFree(start);
+                break;
+            }
+
+            hdskBatch[hdskBatchCount++] = dest;
+            hdskBatch[hdskBatchCount++] = start;
+            for (j = 0; j < 64; j++) {
+                if (clink[j] != NULL)
+                    hdskBatch[hdskBatchCount++] = clink[j];
+            }
+            (*swapped)++;
+        }
+    }
+
+    hdskBatchCommit(device);
+#ifdef HDSK_SUPPORT_HDLFS
+    hdlEndBatch();
+#endif
+
+    return result;
+}
+
 // Move a group of partitions.
+// Non-SONY: the destination is split for up to HDSK_BLOCK_MAX_MOVES partitions at once. Their data is then copied in a single
+// stream, before the headers are swapped with one journal transaction.
+// The move journal only holds the partition that is being copied, and the next copy replaces it. So an interrupted block move
+// restarts from the first partition of the block: that partition is resumed if it was the one being copied, and the others
+// are copied again.
 static int MovePartitionsBlock(int device, apa_cache_t *dest, apa_cache_t *start)
 {
-    u32 remaining;
-    int result, stat;
+    struct hdskMove moves[HDSK_BLOCK_MAX_MOVES];
+    apa_cache_t *to, *from;
+    u32 remaining, count, copied, swapped;
+    int result, stat, done;
 
     remaining = dest->header->length;
     printf("hdsk: MovePartitionsBlock: %08lx to %08lx. sector count = %08lx.\n", start->header->start, dest->header->start, dest->header->length);
 
-    while (1) {
-        if ((result = SplitEmptyPartition(device, dest, start->header->length)) == 0) {
-            if ((result = MovePartition(device, dest, start)) == 0) {
-                remaining -= dest->header->length;
-                if (hdskStopFlag == 0 && remaining != 0) {
-                    // Stop if there are no more partitions to copy (either to or from).
-                    if ((dest = apaGetNextHeader(dest, &stat)) == NULL || (start = apaGetNextHeader(start, &stat)) == NULL)
-                        break;
-                } else
-                    break;
-            } else
+    result  = 0;
+    done    = 0;
+    swapped = 0;
+    while (done == 0 && result == 0 && hdskStopFlag == 0) {
+        for (count = 0; count < HDSK_BLOCK_MAX_MOVES;) {
+            if (dest->header->type != APA_TYPE_FREE) {
+                printf("hdsk: error: destination is not empty.\n");
+                result = -1;
                 break;
-        } else
-            break;
+            }
+
+            if ((result = SplitEmptyPartition(device, dest, start->header->length)) != 0)
+                break;
+
+            moves[count].dest  = dest->header->start;
+            moves[count].src   = start->header->start;
+            moves[count].block = 1;
+            count++;
+
+            remaining -= dest->header->length;
+            if (remaining == 0) {
+                done = 1;
+                break;
+            }
+
+            // Stop if there are no more partitions to copy (either to or from).
+            if ((dest = apaGetNextHeader(dest, &stat)) == NULL || (start = apaGetNextHeader(start, &stat)) == NULL) {
+                done = 1;
+                break;
+            }
+        }
+
+        for (copied = 0; copied < count; copied++) {
+            // The previous partition must be written completely before its headers can be swapped.
+            if (copied > 0 && (result = hdskCopyDrain()) != 0) {
+                copied--;
+                break;
+            }
+
+            to   = apaCacheGetHeader(device, moves[copied].dest, APA_IO_MODE_READ, &result);
+            from = apaCacheGetHeader(device, moves[copied].src, APA_IO_MODE_READ, &result);
+            if (to != NULL && from != NULL) {
+                printf("hdsk: copy %08lx to %08lx. sector count = %08lx.\n", moves[copied].src, moves[copied].dest, from->header->length);
+                result = CopyPartition(device, to->header, from->header);
+            } else if (result == 0)
+                result = -EIO;
+
+            if (to != NULL)
+                apaCacheFree(to);
+            if (from != NULL)
+                apaCacheFree(from);
+
+            // A copy that was stopped may be incomplete.
+            if (result != 0 || hdskStopFlag)
+                break;
+        }
+
+        // The last write belongs to the last partition that was copied, unless the copying stopped before it.
+        if (hdskCopyDrain() != 0) {
+            if (copied == count)
+                copied--;
+            if (result == 0)
+                result = -EIO;
+        }
+
+        if (copied > 0 && (stat = hdskSwapBlock(device, moves, copied, &swapped)) != 0 && result == 0)
+            result = stat;
     }
 
     apaCacheFree(dest);
     apaCacheFree(start);
 
+    // The old locations of the partitions were left as _tmp.
+    if (swapped > 0 && (stat = hdskRemoveTmp(device)) != 0 && result == 0)
+        result = stat;
+
     printf("hdsk: MovePartitionsBlock: done\n");
 
     return result;
 }
 
+// Carries out the moves planned by hdskGetStat. Returns 1 if the remaining moves have to be searched for.
+static int hdskRunPlan(int device)
+{
+    struct hdskPlan *plan;
+    struct hdskMove *move;
+    apa_cache_t *dest, *src;
+    int result;
+    u32 i;
+
+    plan     = hdskPlan;
+    hdskPlan = NULL;
+    if (plan == NULL || plan->device != device)
+        return 1;
+
+    for (i = 0; i < plan->count && hdskStopFlag == 0; i++) {
+        move = &plan->moves[i];
+        if ((result = hdskRemoveTmp(device)) < 0)
+            return result;
+
+        dest = apaCacheGetHeader(device, move->dest, APA_IO_MODE_READ, &result);
+        src  = apaCacheGetHeader(device, move->src, APA_IO_MODE_READ, &result);
+        if (dest == NULL || src == NULL || dest->header->type != APA_TYPE_FREE || src->header->type == APA_TYPE_FREE) {
+            printf("hdsk: partition table differs from the plan at move %lu.\n", i);
+            if (dest != NULL)
+                apaCacheFree(dest);
+            if (src != NULL)
+                apaCacheFree(src);
+            return 1;
+        }
+
+        if (move->block)
+            result = MovePartitionsBlock(device, dest, src);
+        else {
+            result = MovePartition(device, dest, src);
+            apaCacheFree(src);
+            apaCacheFree(dest);
+        }
+
+        if (result != 0)
+            return result;
+    }
+
+    return (plan->overflow && hdskStopFlag == 0) ? 1 : 0;
+}
+
 static void HdskThread(int device)
 {
     u32 PartSize;
@@ -474,7 +1059,8 @@ static void HdskThread(int device)
     hdskStatus   = 0;
     hdskStopFlag = 0;
 
-    if ((hdskStatus = hdskRemoveTmp(device)) >= 0) {
+    if ((hdskStatus = hdskRemoveTmp(device)) >= 0 && (hdskStatus = hdskRunPlan(device)) > 0) {
+        hdskStatus = 0;
         for (PartSize = HDSK_MIN_PART_SIZE; PartSize < HddInfo[device].partitionMaxSize; PartSize *= 2) {
             while ((hdskStatus = hdskRemoveTmp(device)) >= 0) {
                 if ((clink = hdskFindEmptyPartition(device, PartSize)) != NULL) {
@@ -526,6 +1112,7 @@ static void HdskThread(int device)
 
 hdsk_thread_end:
     hdskRemoveTmp(device);
+    hdskBusy = 0;
     SetEventFlag(hdskEventFlagID, 1);
 }
 
@@ -541,27 +1128,38 @@ static int HdskUnsupported(void)
 
 int BitmapUsed;
 u32 TotalCopied;
-struct hdskBitmap hdskBitmap[HDSK_BITMAP_SIZE];
+u32 TotalHeaders;
+struct hdskBitmap *hdskBitmap;
 
 static int hdskBitmapInit(int device)
 {
-    struct hdskBitmap *pBitmap;
+    const apa_index_entry_t *entry;
     apa_cache_t *clink;
     int result;
 
-    clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &result);
-    memset(hdskBitmap, 0, sizeof(hdskBitmap));
+    if (apaIndexIsValid(device)) {
+        if ((result = hdskSimInit(apaIndexGetCount(device))) != 0)
+            return result;
+
+        for (BitmapUsed = 0; BitmapUsed < apaIndexGetCount(device); BitmapUsed++) {
+            entry = apaIndexGetEntry(device, BitmapUsed);
+            if ((result = hdskSimAppend(entry->start, entry->length, entry->type, entry->type == APA_TYPE_FREE ? 0 : ((entry->flags & APA_FLAG_SUB) ? 1 : entry->nsub))) != 0)
+                return result;
+        }
 
-    hdskBitmap[0].next = hdskBitmap;
-    hdskBitmap[0].prev = hdskBitmap;
+        return 0;
+    }
 
-    for (BitmapUsed = 0; clink != NULL;) {
-        pBitmap         = &hdskBitmap[BitmapUsed + 1];
-        pBitmap->start  = clink->header->start;
-        pBitmap->length = clink->header->length;
-        pBitmap->type   = clink->header->type;
+    if ((result = hdskSimInit(0)) != 0)
+        return result;
+
+    clink = apaCacheGetHeader(device, 0, APA_IO_MODE_READ, &result);
 
-        apaCacheLink((apa_cache_t *)hdskBitmap[0].prev, (apa_cache_t *)pBitmap);
+    for (BitmapUsed = 0; clink != NULL;) {
+        if ((result = hdskSimAppend(clink->header->start, clink->header->length, clink->header->type, clink->header->type == APA_TYPE_FREE ? 0 : ((clink->header->flags & APA_FLAG_SUB) ? 1 : clink->header->nsub))) != 0) {
+            apaCacheFree(clink);
+            return result;
+        }
 
         BitmapUsed++;
         clink = apaGetNextHeader(clink, &result);
@@ -570,47 +1168,247 @@ static int hdskBitmapInit(int device)
     return result;
 }
 
-static int hdskGetStat(int device, struct hdskStat *buf, apa_device_t *deviceInfo)
+// Looks for the partitions that could be moved into the empty partition, in the order that HdskThread tries them.
+// The candidate that is numbered by choice is returned in src, or the first one if there are fewer. Returns 1 for a block of partitions.
+static int hdskPlanFindMove(struct hdskBitmap *empty, u32 PartSize, int blocks, u8 *choice, u8 *candidates, struct hdskBitmap **src)
+{
+    struct hdskBitmap *found[HDSK_PLAN_CANDIDATES];
+    int block[HDSK_PLAN_CANDIDATES];
+    int IsValidPartSize, rule, i;
+    u32 count;
+
+    IsValidPartSize = blocks && HDSK_MIN_PART_SIZE < PartSize;
+    for (rule = 0, count = 0; rule < HDSK_PLAN_CANDIDATES; rule++) {
+        if (rule & 1) {
+            if (!IsValidPartSize || (found[count] = hdskSimFindLastUsedBlock(PartSize, empty->start, rule < 2)) == NULL)
+                continue;
+        } else if ((found[count] = hdskSimFindLastUsedPartition(PartSize, empty->start, rule < 2)) == NULL)
+            continue;
+        block[count] = rule & 1;
+
+        for (i = 0; i < count && (found[i] != found[count] || block[i] != block[count]); i++)
+            ;
+        if (i == count)
+            count++;
+    }
+
+    *candidates = count;
+    if (count == 0)
+        return -1;
+
+    if (*choice >= count)
+        *choice = 0;
+    *src = found[*choice];
+
+    return block[*choice];
+}
+
+// Simulates the defragmentation and records the moves. Moves after the installable space stops growing are dropped, since they only cost time.
+// The first fixed steps take the candidates in choices. The steps after them take the first candidate, like HdskThread does.
+static int hdskPlanRun(int device, apa_device_t *deviceInfo, struct hdskPlan *plan, int blocks, const u8 *choices, u32 fixed)
 {
-    int result, IsValidPartSize;
-    apa_device_t *pDeviceInfo;
     struct hdskBitmap *pPartBitmap, *pSelEmptyPartBM;
-    u32 PartSize;
+    struct hdskMove *move;
+    u32 PartSize, free, count;
+    int result, block;
+    u8 choice, candidates;
+
+    TotalCopied    = 0;
+    TotalHeaders   = 0;
+    plan->device   = device;
+    plan->overflow = 0;
+    plan->blocks   = blocks;
+    plan->count    = 0;
+    plan->copied   = 0;
+    plan->headers  = 0;
+    count          = 0;
+
+    if ((result = hdskBitmapInit(device)) != 0)
+        return result;
+
+    plan->free = hdskSimGetFree(device, deviceInfo);
+    for (PartSize = HDSK_MIN_PART_SIZE; PartSize < deviceInfo[device].partitionMaxSize; PartSize *= 2) {
+        while ((pPartBitmap = hdskSimFindEmptyPartition(PartSize)) != NULL) {
+            choice = count < fixed ? choices[count] : 0;
+            if ((block = hdskPlanFindMove(pPartBitmap, PartSize, blocks, &choice, &candidates, &pSelEmptyPartBM)) < 0) {
+                printf("hdsk: there is no copyable partition/partitions block.\n");
+                break;
+            }
 
-    TotalCopied = 0;
+            // A block move splits the empty partition for each partition in the block.
+            if (block && (result = hdskSimReserve(PartSize / HDSK_MIN_PART_SIZE, &pPartBitmap, &pSelEmptyPartBM)) != 0)
+                return result;
 
-    PartSize = HDSK_MIN_PART_SIZE;
-    if ((result = hdskBitmapInit(device)) == 0) {
-        hdskSimGetFreeSectors(device, buf, deviceInfo);
+            if (count < HDSK_PLAN_MAX_MOVES) {
+                move                    = &plan->moves[count];
+                move->dest              = pPartBitmap->start;
+                move->src               = pSelEmptyPartBM->start;
+                move->block             = block;
+                plan->choices[count]    = choice;
+                plan->candidates[count] = candidates;
+            } else
+                plan->overflow = 1;
+            count++;
 
-        for (pDeviceInfo = &deviceInfo[device]; PartSize < pDeviceInfo->partitionMaxSize; PartSize *= 2) {
-            IsValidPartSize = HDSK_MIN_PART_SIZE < PartSize;
+            if (block) {
+                printf("hdsk: found last used block of partitions at %08lx, size %08lx.\n", pSelEmptyPartBM->start, pSelEmptyPartBM->length);
+                hdskSimMovePartitionsBlock(pPartBitmap, pSelEmptyPartBM);
+            } else {
+                printf("hdsk: found last used partition at %08lx, size %08lx.\n", pSelEmptyPartBM->start, pSelEmptyPartBM->length);
+                hdskSimMovePartition(pPartBitmap, pSelEmptyPartBM);
+            }
 
-            while ((pPartBitmap = hdskSimFindEmptyPartition(PartSize)) != NULL) {
-                if (((pSelEmptyPartBM = hdskSimFindLastUsedPartition(PartSize, pPartBitmap->start, 1)) == NULL) &&
-                    (!IsValidPartSize || (pSelEmptyPartBM = hdskSimFindLastUsedBlock(PartSize, pPartBitmap->start, 1)) == NULL) &&
-                    ((pSelEmptyPartBM = hdskSimFindLastUsedPartition(PartSize, pPartBitmap->start, 0)) == NULL)) {
-                    if (IsValidPartSize && (pSelEmptyPartBM = hdskSimFindLastUsedBlock(PartSize, pPartBitmap->start, 0)) != NULL) {
-                        printf("hdsk: found last used block of partitions at %08lx, size %08lx.\n", pSelEmptyPartBM->start, pSelEmptyPartBM->length);
-                        hdskSimMovePartitionsBlock(pPartBitmap, pSelEmptyPartBM);
-                    } else {
-                        printf("hdsk: there is no copyable partition/partitions block.\n");
-                        break;
-                    }
-                } else {
-                    printf("hdsk: found last used partition at %08lx, size %08lx.\n", pSelEmptyPartBM->start, pSelEmptyPartBM->length);
-                    hdskSimMovePartition(pPartBitmap, pSelEmptyPartBM);
-                }
+            if ((free = hdskSimGetFree(device, deviceInfo)) > plan->free) {
+                plan->free    = free;
+                plan->copied  = TotalCopied;
+                plan->headers = TotalHeaders;
+                plan->count   = count;
             }
         }
+    }
 
-        // 0x00004368
-        hdskSimGetFreeSectors(device, buf, deviceInfo);
-        printf("copy total %08lx sectors\n", TotalCopied);
-        buf->total = TotalCopied;
+    plan->steps = count < HDSK_PLAN_MAX_MOVES ? count : HDSK_PLAN_MAX_MOVES;
+
+    // Unrecorded moves will be found again by HdskThread, so they must all be done.
+    if (plan->overflow) {
+        plan->copied  = TotalCopied;
+        plan->headers = TotalHeaders;
+        plan->count   = HDSK_PLAN_MAX_MOVES;
     }
 
-    return result;
+    return 0;
+}
+
+// The cost of a plan is the time that it takes, in sectors copied.
+static u64 hdskPlanCost(const struct hdskPlan *plan)
+{
+    return plan->copied + (u64)plan->headers * HDSK_PLAN_HEADER_COST;
+}
+
+static int hdskPlanIsBetter(const struct hdskPlan *plan, const struct hdskPlan *best)
+{
+    return plan->free > best->free || (plan->free == best->free && hdskPlanCost(plan) < hdskPlanCost(best));
+}
+
+// Searches for the plan that frees the most space at the least cost. The greedy plans, with and without blocks of partitions,
+// are improved by taking another candidate at one step and simulating the rest of the plan again. A better plan replaces the best
+// one, and the search goes on from it. The number of plans that are simulated is limited, so that the search does not take long.
+static int hdskGetStat(int device, struct hdskStat *buf, apa_device_t *deviceInfo)
+{
+    struct hdskPlan *best, *trial, *swap;
+    u32 step, evaluations;
+    int result;
+    u8 choice;
+
+    hdskPlan = NULL;
+    best     = &hdskPlans[0];
+    trial    = &hdskPlans[1];
+    if ((result = hdskPlanRun(device, deviceInfo, best, 1, NULL, 0)) != 0 || (result = hdskPlanRun(device, deviceInfo, trial, 0, NULL, 0)) != 0) {
+        hdskSimDeinit();
+        return result;
+    }
+
+    if (hdskPlanIsBetter(trial, best)) {
+        swap  = best;
+        best  = trial;
+        trial = swap;
+    }
+
+    for (step = 0, evaluations = 0; step < best->steps && evaluations < HDSK_PLAN_EVALUATIONS; step++) {
+        for (choice = 0; choice < best->candidates[step] && evaluations < HDSK_PLAN_EVALUATIONS; choice++) {
+            if (choice == best->choices[step])
+                continue;
+
+            memcpy(hdskPlanChoices, best->choices, step);
+            hdskPlanChoices[step] = choice;
+            if ((result = hdskPlanRun(device, deviceInfo, trial, best->blocks, hdskPlanChoices, step + 1)) != 0) {
+                hdskSimDeinit();
+                return result;
+            }
+            evaluations++;
+
+            if (hdskPlanIsBetter(trial, best)) {
+                printf("hdsk: plan: step %lu, candidate %d: %lu moves, copy %08lx sectors, installable = %08lx sectors.\n", step, choice, trial->count, trial->copied, trial->free);
+                swap  = best;
+                best  = trial;
+                trial = swap;
+                break;
+            }
+        }
+    }
+
+    hdskPlan = best;
+    printf("hdsk: plan: %lu moves, copy %08lx sectors, installable = %08lx sectors, %lu plans searched.\n", best->count, best->copied, best->free, evaluations + 2);
+    hdskSimDeinit();
+    printf("copy total %08lx sectors\n", hdskPlan->copied);
+    buf->free  = hdskPlan->free;
+    buf->total = hdskPlan->copied;
+
+    return 0;
+}
+
+// Times reads of the data that will be copied first. Copying reads and writes every sector, so the copy rate is half of that.
+static u32 hdskMeasureCopyRate(int device, u32 lba)
+{
+    iop_sys_clock_t clock;
+    u32 start, end, sectors, sec, usec, msec;
+
+    GetSystemTime(&clock);
+    start = clock.lo;
+    for (sectors = 0; sectors < HDSK_RATE_SAMPLE_SECTORS; sectors += hdskCopySectors) {
+        if (ata_device_sector_io(device, hdskCopyBuffers[0], lba + sectors, hdskCopySectors, ATA_DIR_READ) != 0)
+            return 0;
+    }
+    GetSystemTime(&clock);
+    end = clock.lo;
+
+    clock.lo = end - start; // Shorter than the 2 minutes that the low word takes to wrap around.
+    clock.hi = 0;
+    SysClock2USec(&clock, &sec, &usec);
+    msec = sec * 1000 + usec / 1000;
+
+    return msec > 0 ? sectors * (1000 / 2) / msec : 0;
+}
+
+static int hdskGetEstimate(int device, struct hdskEstimate *estimate, apa_device_t *deviceInfo)
+{
+    struct hdskStat stat;
+    int result;
+
+    if ((result = hdskGetStat(device, &stat, deviceInfo)) != 0)
+        return result;
+
+    // The rate is only measured once for each transfer size.
+    if (hdskCopyRate == 0 && hdskPlan->count > 0)
+        hdskCopyRate = hdskMeasureCopyRate(device, hdskPlan->moves[0].src);
+
+    estimate->free    = stat.free;
+    estimate->total   = stat.total;
+    estimate->headers = hdskPlan->headers;
+    estimate->moves   = hdskPlan->count;
+    estimate->rate    = hdskCopyRate;
+    estimate->seconds = estimate->rate > 0 ? (stat.total + estimate->rate - 1) / estimate->rate : 0;
+
+    printf("hdsk: estimate: %lu headers, %lu sectors/s, %lu seconds.\n", estimate->headers, estimate->rate, estimate->seconds);
+
+    return 0;
+}
+
+// Reads the partition table again, after it was changed through HDD.IRX (e.g. by FSSK, in the same IOP session).
+static int hdskRescan(int device)
+{
+    int result;
+
+    if (hdskBusy)
+        return -EBUSY;
+
+    apaCacheInvalidate(device);
+    apaIndexInvalidate(device);
+    hdskPlan = NULL;
+    if ((result = apaJournalRestore(device)) != 0)
+        return result;
+
+    return apaIndexBuild(device);
 }
 
 static int HdskDevctl(iop_file_t *fd, const char *name, int cmd, void *arg, unsigned int arglen, void *buf, unsigned int buflen)
@@ -629,8 +1427,18 @@ static int HdskDevctl(iop_file_t *fd, const char *name, int cmd, void *arg, unsi
             if ((result = hdskRemoveTmp(fd->unit)) == 0)
                 result = hdskGetStat(fd->unit, buf, HddInfo);
             break;
+        case HDSK_DEVCTL_GET_ESTIMATE:
+            if (hdskBusy)
+                result = -EBUSY;
+            else if (buflen < sizeof(struct hdskEstimate))
+                result = -EINVAL;
+            else if ((result = hdskRemoveTmp(fd->unit)) == 0)
+                result = hdskGetEstimate(fd->unit, buf, HddInfo);
+            break;
         case HDSK_DEVCTL_START:
-            result = StartThread(hdskThreadID, (void *)fd->unit);
+            hdskBusy = 1;
+            if ((result = StartThread(hdskThreadID, (void *)fd->unit)) != 0)
+                hdskBusy = 0;
             break;
         case HDSK_DEVCTL_WAIT:
             result = WaitEventFlag(hdskEventFlagID, 1, WEF_CLEAR | WEF_OR, &bits);
@@ -650,6 +1458,15 @@ static int HdskDevctl(iop_file_t *fd, const char *name, int cmd, void *arg, unsi
         case HDSK_DEVCTL_GET_PROGRESS:
             result = (int)hdskProgress;
             break;
+        case HDSK_DEVCTL_SET_TRANSFER_SIZE:
+            result = (arglen >= sizeof(u32)) ? hdskSetTransferSize(*(u32 *)arg) : -EINVAL;
+            break;
+        case HDSK_DEVCTL_SET_VERIFY:
+            result = (arglen >= sizeof(u32)) ? hdskSetVerify(*(u32 *)arg != 0) : -EINVAL;
+            break;
+        case HDSK_DEVCTL_RESCAN:
+            result = hdskRescan(fd->unit);
+            break;
         default:
             result = -EINVAL;
     }
@@ -732,6 +1549,9 @@ int _start(int argc, char *argv[])
 
             if (apaGetFormat(i, &HddInfo[i].format))
                 HddInfo[i].status--;
+
+            if (HddInfo[i].status == 0)
+                apaIndexBuild(i);
         }
     }
 
@@ -741,6 +1561,13 @@ int _start(int argc, char *argv[])
     if ((hdskThreadID = HdskCreateThread((void *)&HdskThread, 0x2080)) < 0)
         return MODULE_NO_RESIDENT_END;
 
+    Crc32Init();
+    if (hdskSetTransferSize(IOBUFFER_SIZE_SECTORS) != 0)
+        return MODULE_NO_RESIDENT_END;
+
+    if (CopyInit("hdsk", &hdskCopyIO) != 0)
+        return MODULE_NO_RESIDENT_END;
+
     DelDrv("hdsk");
     if (AddDrv(&HdskDevice) == 0) {
         printf("hdsk: driver start.\n");
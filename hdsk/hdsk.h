@@ -5,7 +5,44 @@ struct hdskBitmap
     u32 start;               // 0x08
     u32 length;              // 0x0C
     u32 type;                // 0x10
+    u32 related;             // Non-SONY: other headers that are rewritten when the partition is moved (main or sub-partitions).
+    // Non-SONY: partitions of the same size class and state (free or used) are linked in order of their start.
+    struct hdskBitmap *classNext;
+    struct hdskBitmap *classPrev;
+    int listed;
 };
 
-#define HDSK_BITMAP_SIZE      0x4001
+#define HDSK_BITMAP_SLACK   32 // Room for partitions that are split, in addition to the partitions on the disk.
+#define HDSK_BITMAP_CLASSES 32
+
+// Non-SONY: moves planned by simulating the defragmentation, before it is done.
+struct hdskMove
+{
+    u32 dest;
+    u32 src;
+    u32 block; // Moved as a block of partitions.
+};
+
+#define HDSK_PLAN_MAX_MOVES 1024
+
+struct hdskPlan
+{
+    int device;
+    int overflow; // Moves beyond HDSK_PLAN_MAX_MOVES were not recorded.
+    int blocks;   // Blocks of partitions may be moved.
+    u32 count;
+    u32 steps;   // Moves that were simulated, including those after the installable space stopped growing.
+    u32 free;    // Installable space after the moves.
+    u32 copied;  // Sectors copied by the moves.
+    u32 headers; // APA headers rewritten by the moves.
+    struct hdskMove moves[HDSK_PLAN_MAX_MOVES];
+    u8 choices[HDSK_PLAN_MAX_MOVES];    // Candidate that was taken at each step.
+    u8 candidates[HDSK_PLAN_MAX_MOVES]; // Candidates that there were to choose from at each step.
+};
 #define IOBUFFER_SIZE_SECTORS 256 // Equal to the size of a 128MB partition. Do not alter (partitions must be a multiple of this).
+#define HDSK_COPY_BUFFERS         2
+#define HDSK_MAX_TRANSFER_SECTORS 65536 // Largest transfer that a single LBA48 command can do.
+
+// Non-SONY: limits for moving a block of partitions in one go.
+#define HDSK_BLOCK_MAX_MOVES  64 // Partitions that are copied before their headers are swapped.
+#define HDSK_BATCH_HEADERS    96 // Headers rewritten by one journal transaction (the APA journal holds up to 126).
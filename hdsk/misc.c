@@ -46,6 +46,15 @@ void *AllocMemory(int size)
     return result;
 }
 
+void FreeMemory(void *buffer)
+{
+    int OldState;
+
+    CpuSuspendIntr(&OldState);
+    FreeSysMemory(buffer);
+    CpuResumeIntr(OldState);
+}
+
 int HdskRI(unsigned char *id)
 {
     u32 stat;
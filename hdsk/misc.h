@@ -1,5 +1,6 @@
 int HdskReadClock(apa_ps2time_t *time);
 void *AllocMemory(int size);
+void FreeMemory(void *buffer);
 int HdskRI(unsigned char *id);
 int HdskUnlockHdd(int unit);
 int HdskCreateEventFlag(void);
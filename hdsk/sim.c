@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <sysclib.h>
 #include <hdd-ioctl.h>
@@ -7,11 +8,158 @@
 #include "hdsk-devctl.h"
 #include "hdsk.h"
 #include "sim.h"
+#include "misc.h"
 
 extern u32 TotalCopied;
-extern struct hdskBitmap hdskBitmap[];
+extern u32 TotalHeaders;
+extern struct hdskBitmap *hdskBitmap;
 
-void hdskSimGetFreeSectors(s32 device, struct hdskStat *stat, apa_device_t *deviceinfo)
+// Non-SONY: the model is allocated for the partitions on the disk, rather than for the largest possible number of partitions.
+static u32 hdskBitmapCapacity, hdskBitmapUsed, hdskBitmapFreeHint;
+static struct hdskBitmap *hdskSimClassHead[2][HDSK_BITMAP_CLASSES]; // Free and used partitions, by size class.
+static struct hdskBitmap *hdskSimClassTail[2][HDSK_BITMAP_CLASSES];
+
+static int hdskSimSizeClass(u32 length)
+{
+    int i;
+
+    for (i = 0; length > 1; i++)
+        length >>= 1;
+
+    return i;
+}
+
+static void hdskSimClassLink(struct hdskBitmap *part)
+{
+    struct hdskBitmap **head, **tail, *prev;
+    int list, SizeClass;
+
+    list      = part->type != 0;
+    SizeClass = hdskSimSizeClass(part->length);
+    head      = &hdskSimClassHead[list][SizeClass];
+    tail      = &hdskSimClassTail[list][SizeClass];
+
+    // Partitions are usually added near the end.
+    for (prev = *tail; prev != NULL && prev->start > part->start; prev = prev->classPrev)
+        ;
+
+    part->classPrev = prev;
+    part->classNext = (prev != NULL) ? prev->classNext : *head;
+    if (part->classNext != NULL)
+        part->classNext->classPrev = part;
+    else
+        *tail = part;
+    if (prev != NULL)
+        prev->classNext = part;
+    else
+        *head = part;
+    part->listed = 1;
+}
+
+static void hdskSimClassUnlink(struct hdskBitmap *part)
+{
+    int list, SizeClass;
+
+    if (!part->listed)
+        return;
+
+    list      = part->type != 0;
+    SizeClass = hdskSimSizeClass(part->length);
+    if (part->classPrev != NULL)
+        part->classPrev->classNext = part->classNext;
+    else
+        hdskSimClassHead[list][SizeClass] = part->classNext;
+    if (part->classNext != NULL)
+        part->classNext->classPrev = part->classPrev;
+    else
+        hdskSimClassTail[list][SizeClass] = part->classPrev;
+
+    part->classNext = NULL;
+    part->classPrev = NULL;
+    part->listed    = 0;
+}
+
+void hdskSimDeinit(void)
+{
+    if (hdskBitmap != NULL) {
+        FreeMemory(hdskBitmap);
+        hdskBitmap = NULL;
+    }
+}
+
+int hdskSimInit(u32 partitions)
+{
+    hdskSimDeinit();
+
+    hdskBitmapCapacity = partitions + 1 + HDSK_BITMAP_SLACK; // The first entry is the head of the list.
+    if ((hdskBitmap = AllocMemory(hdskBitmapCapacity * sizeof(struct hdskBitmap))) == NULL)
+        return -ENOMEM;
+
+    memset(hdskBitmap, 0, hdskBitmapCapacity * sizeof(struct hdskBitmap));
+    memset(hdskSimClassHead, 0, sizeof(hdskSimClassHead));
+    memset(hdskSimClassTail, 0, sizeof(hdskSimClassTail));
+    hdskBitmap[0].next = hdskBitmap;
+    hdskBitmap[0].prev = hdskBitmap;
+    hdskBitmapUsed     = 1;
+    hdskBitmapFreeHint = 1;
+
+    return 0;
+}
+
+static struct hdskBitmap *hdskSimRebase(struct hdskBitmap *part, struct hdskBitmap *old)
+{
+    return part != NULL ? hdskBitmap + (part - old) : NULL;
+}
+
+// Makes room for count more partitions. If the model has to be moved, the partitions that a and b point to are updated.
+int hdskSimReserve(u32 count, struct hdskBitmap **a, struct hdskBitmap **b)
+{
+    struct hdskBitmap *old, *part;
+    u32 capacity, i;
+    int list, SizeClass;
+
+    if (hdskBitmapUsed + count <= hdskBitmapCapacity)
+        return 0;
+
+    for (capacity = hdskBitmapCapacity * 2; capacity < hdskBitmapUsed + count; capacity *= 2)
+        ;
+
+    old = hdskBitmap;
+    if ((hdskBitmap = AllocMemory(capacity * sizeof(struct hdskBitmap))) == NULL) {
+        hdskBitmap = old;
+        return -ENOMEM;
+    }
+
+    // Keep the order of the entries, as hdskSimCalcFreeSectors goes through them in that order.
+    memcpy(hdskBitmap, old, hdskBitmapCapacity * sizeof(struct hdskBitmap));
+    memset(&hdskBitmap[hdskBitmapCapacity], 0, (capacity - hdskBitmapCapacity) * sizeof(struct hdskBitmap));
+    for (i = 0; i < hdskBitmapCapacity; i++) {
+        part            = &hdskBitmap[i];
+        part->next      = hdskSimRebase(part->next, old);
+        part->prev      = hdskSimRebase(part->prev, old);
+        part->classNext = hdskSimRebase(part->classNext, old);
+        part->classPrev = hdskSimRebase(part->classPrev, old);
+    }
+
+    for (list = 0; list < 2; list++) {
+        for (SizeClass = 0; SizeClass < HDSK_BITMAP_CLASSES; SizeClass++) {
+            hdskSimClassHead[list][SizeClass] = hdskSimRebase(hdskSimClassHead[list][SizeClass], old);
+            hdskSimClassTail[list][SizeClass] = hdskSimRebase(hdskSimClassTail[list][SizeClass], old);
+        }
+    }
+
+    if (a != NULL)
+        *a = hdskSimRebase(*a, old);
+    if (b != NULL)
+        *b = hdskSimRebase(*b, old);
+
+    FreeMemory(old);
+    hdskBitmapCapacity = capacity;
+
+    return 0;
+}
+
+static u32 hdskSimCalcFreeSectors(s32 device, struct hdskStat *stat, apa_device_t *deviceinfo)
 {
     u32 sectors, partMax;
     int i;
@@ -41,19 +189,44 @@ void hdskSimGetFreeSectors(s32 device, struct hdskStat *stat, apa_device_t *devi
             break;
     }
 
+    return sectors;
+}
+
+void hdskSimGetFreeSectors(s32 device, struct hdskStat *stat, apa_device_t *deviceinfo)
+{
+    u32 sectors;
+
+    sectors = hdskSimCalcFreeSectors(device, stat, deviceinfo);
     APA_PRINTF(APA_DRV_NAME ": total = %08lx sectors, installable = %08lx sectors.\n", sectors, stat->free);
 }
 
+u32 hdskSimGetFree(s32 device, apa_device_t *deviceinfo)
+{
+    struct hdskStat stat;
+
+    hdskSimCalcFreeSectors(device, &stat, deviceinfo);
+
+    return stat.free;
+}
+
 static void hdskSimClearHeader(struct hdskBitmap *header)
 {
+    u32 slot;
+
+    hdskSimClassUnlink(header);
     memset(header, 0, sizeof(struct hdskBitmap));
+
+    hdskBitmapUsed--;
+    if ((slot = header - hdskBitmap) < hdskBitmapFreeHint)
+        hdskBitmapFreeHint = slot;
 }
 
 static struct hdskBitmap *hdskSimDeleteFixPrev(struct hdskBitmap *part)
 {
-    struct hdskBitmap *prev;
+    struct hdskBitmap *prev, *orig;
     u32 length;
 
+    orig = part;
     while (hdskBitmap[0].next != part) {
         prev = part->prev;
         if (prev->type == 0) {
@@ -62,7 +235,9 @@ static struct hdskBitmap *hdskSimDeleteFixPrev(struct hdskBitmap *part)
                 break;
 
             if ((length & (length - 1)) == 0) {
+                hdskSimClassUnlink(prev);
                 prev->length = length;
+                hdskSimClassLink(prev);
                 hdskSimClearHeader((struct hdskBitmap *)apaCacheUnLink((apa_cache_t *)part));
             } else
                 break;
@@ -72,14 +247,19 @@ static struct hdskBitmap *hdskSimDeleteFixPrev(struct hdskBitmap *part)
         part = prev;
     }
 
+    // The merged partition and the next one.
+    if (part != orig)
+        TotalHeaders += 2;
+
     return part;
 }
 
 static struct hdskBitmap *hdskSimDeleteFixNext(struct hdskBitmap *part)
 {
     struct hdskBitmap *next;
-    u32 length;
+    u32 length, OrigLen;
 
+    OrigLen = part->length;
     while (hdskBitmap[0].prev != part) {
         next = part->next;
         if (next->type == 0) {
@@ -88,15 +268,21 @@ static struct hdskBitmap *hdskSimDeleteFixNext(struct hdskBitmap *part)
                 break;
 
             if ((length & (length - 1)) == 0) {
+                // Non-SONY: the next partition is merged into this one, so it is the one to remove.
+                hdskSimClassUnlink(part);
                 part->length = length;
                 part->type   = 0;
-                hdskSimClearHeader((struct hdskBitmap *)apaCacheUnLink((apa_cache_t *)part));
+                hdskSimClassLink(part);
+                hdskSimClearHeader((struct hdskBitmap *)apaCacheUnLink((apa_cache_t *)next));
             } else
                 break;
         } else
             break;
     }
 
+    if (part->length != OrigLen)
+        TotalHeaders += 2;
+
     return part;
 }
 
@@ -106,10 +292,13 @@ static void hdskSimSwapPartition(struct hdskBitmap *start)
     int i;
     struct hdskBitmap *part;
 
+    TotalHeaders++; // The _tmp partition is written before it is deleted.
+
     part = hdskBitmap[0].prev;
     if (start == part) {
         do {
             hdskSimClearHeader((struct hdskBitmap *)apaCacheUnLink((apa_cache_t *)part));
+            TotalHeaders += 2; // The new last partition and the MBR.
             part = hdskBitmap[0].prev;
             if (part == NULL)
                 break;
@@ -120,8 +309,12 @@ static void hdskSimSwapPartition(struct hdskBitmap *start)
         for (i = 0; i < 2; i++)
             start = hdskSimDeleteFixNext(hdskSimDeleteFixPrev(start));
 
-        if (start->start == OrigStart && start->length == OrigLen)
+        if (start->start == OrigStart && start->length == OrigLen) {
+            hdskSimClassUnlink(start);
             start->type = 0;
+            hdskSimClassLink(start);
+            TotalHeaders++;
+        }
     }
 }
 
@@ -130,9 +323,14 @@ void hdskSimMovePartition(struct hdskBitmap *dest, struct hdskBitmap *start)
     printf("hdsk: MovePartition: %08lx to %08lx. sector count = %08lx.\n", start->start, dest->start, start->length);
 
     TotalCopied += start->length;
+    TotalHeaders += 2 + start->related;
     printf("hdsk: swap partition start...");
 
-    dest->type = start->type;
+    hdskSimClassUnlink(dest);
+    dest->type     = start->type;
+    dest->related  = start->related;
+    start->related = 0;
+    hdskSimClassLink(dest);
     hdskSimSwapPartition(start);
 
     printf("done\n");
@@ -143,8 +341,9 @@ struct hdskBitmap *hdskSimFindEmptyPartition(u32 size)
 {
     struct hdskBitmap *part;
 
-    for (part = hdskBitmap; part->next != hdskBitmap; part = part->next) {
-        if (part->length == size && part->type == 0) {
+    // The first free partition of the size, other than the last partition.
+    for (part = hdskSimClassHead[0][hdskSimSizeClass(size)]; part != NULL && part != hdskBitmap[0].prev; part = part->classNext) {
+        if (part->length == size) {
             printf("hdsk: sim: found empty partition at %08lx, size %08lx.\n", part->start, part->length);
             return part;
         }
@@ -169,8 +368,8 @@ struct hdskBitmap *hdskSimFindLastUsedPartition(u32 size, u32 start, int mode)
     struct hdskBitmap *part;
 
     SliceSize = size * 2;
-    for (part = hdskBitmap[0].prev; start < part->start && part != hdskBitmap; part = part->prev) {
-        if (part->length == size && part->type != 0) {
+    for (part = hdskSimClassTail[1][hdskSimSizeClass(size)]; part != NULL && start < part->start; part = part->classPrev) {
+        if (part->length == size) {
             if (mode != 0) {
                 if (part->start % SliceSize != 0) {
                     if (hdskCheckIfPrevPartEmpty(part, size) != 0)
@@ -229,28 +428,60 @@ struct hdskBitmap *hdskSimFindLastUsedBlock(u32 size, u32 start, int mode)
 static struct hdskBitmap *hdskBitmapAlloc(void)
 {
     struct hdskBitmap *part;
-    unsigned int i;
+    u32 i;
 
-    for (part = &hdskBitmap[1], i = 1; i < HDSK_BITMAP_SIZE; i++, part++) {
-        if (part->length == 0)
+    // Use the first unused entry, like before the model was allocated dynamically.
+    for (part = &hdskBitmap[hdskBitmapFreeHint], i = hdskBitmapFreeHint; i < hdskBitmapCapacity; i++, part++) {
+        if (part->length == 0) {
+            hdskBitmapFreeHint = i + 1;
+            hdskBitmapUsed++;
             return part;
+        }
     }
 
     return NULL;
 }
 
+int hdskSimAppend(u32 start, u32 length, u32 type, u32 related)
+{
+    struct hdskBitmap *part;
+    int result;
+
+    if ((result = hdskSimReserve(1, NULL, NULL)) != 0)
+        return result;
+
+    part          = hdskBitmapAlloc();
+    part->start   = start;
+    part->length  = length;
+    part->type    = type;
+    part->related = related;
+    apaCacheLink((apa_cache_t *)hdskBitmap[0].prev, (apa_cache_t *)part);
+    hdskSimClassLink(part);
+
+    return 0;
+}
+
 static void hdskSimSplitEmptyPartition(struct hdskBitmap *part, u32 length)
 {
     struct hdskBitmap *end;
 
     printf("hdsk: split empty partition.\n");
     while (part->length != length) {
-        end = hdskBitmapAlloc();
+        if ((end = hdskBitmapAlloc()) == NULL) { // Space is reserved by the caller.
+            printf("hdsk: sim: out of entries.\n");
+            break;
+        }
+
+        hdskSimClassUnlink(part);
         part->length /= 2;
+        hdskSimClassLink(part);
         end->start  = part->start + part->length;
-        end->type   = 0;
-        end->length = part->length;
+        end->type    = 0;
+        end->length  = part->length;
+        end->related = 0;
         apaCacheLink((apa_cache_t *)part, (apa_cache_t *)end);
+        hdskSimClassLink(end);
+        TotalHeaders += 3; // Both halves and the next partition.
     }
 }
 
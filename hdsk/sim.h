@@ -1,4 +1,9 @@
+int hdskSimInit(u32 partitions);
+void hdskSimDeinit(void);
+int hdskSimReserve(u32 count, struct hdskBitmap **a, struct hdskBitmap **b);
+int hdskSimAppend(u32 start, u32 length, u32 type, u32 related);
 void hdskSimGetFreeSectors(s32 device, struct hdskStat *stat, apa_device_t *deviceinfo);
+u32 hdskSimGetFree(s32 device, apa_device_t *deviceinfo);
 void hdskSimMovePartition(struct hdskBitmap *dest, struct hdskBitmap *start);
 struct hdskBitmap *hdskSimFindEmptyPartition(u32 size);
 struct hdskBitmap *hdskSimFindLastUsedPartition(u32 size, u32 start, int mode);
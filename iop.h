@@ -20,6 +20,7 @@
 #define IOP_MODSET_SA_FSCK (IOP_REBOOT | IOP_MOD_FSCK | IOP_MOD_HDD) // For the standalone FSCK tool
 #define IOP_MODSET_HDSK    (IOP_REBOOT | IOP_MOD_HDSK | IOP_MOD_HDLOG)
 #define IOP_MODSET_FSSK    (IOP_REBOOT | IOP_MOD_FSSK | IOP_MOD_HDD | IOP_MOD_HDLOG)
+#define IOP_MODSET_SHRINK  (IOP_REBOOT | IOP_MOD_FSSK | IOP_MOD_HDD | IOP_MOD_HDSK | IOP_MOD_HDLOG) // FSSK, then HDSK without an IOP reboot in between
 
 #ifndef LOG_MESSAGES
 #define FSCK_VERBOSITY 0
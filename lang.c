@@ -61,7 +61,10 @@ static const char *DefaultLanguageStringTable[SYS_UI_MSG_COUNT] = {
     "Abort zero-fill operation?",
     "Press START+SELECT to continue.\nPress any other button to abort.",
     "The HardDisk Drive (HDD) unit has a problem.\nPlease run a disk check first.",
-    "S.M.A.R.T. has reported that the HardDisk Drive (HDD) unit has failed.\n\nThe HDD unit must be replaced."};
+    "S.M.A.R.T. has reported that the HardDisk Drive (HDD) unit has failed.\n\nThe HDD unit must be replaced.",
+    "Shrink a partition.\nThe space freed can be used by new partitions.",
+    "Proceed with shrinking the partition?\nFiles will be moved off the space that is freed.",
+    "There are no partitions that can be shrunk."};
 
 static const char *DefaultLanguageLabelStringTable[SYS_UI_LBL_COUNT] = {
     "OK",
@@ -110,6 +113,10 @@ static const char *DefaultLanguageLabelStringTable[SYS_UI_LBL_COUNT] = {
     "Scan Results",
     "Errors found:",
     "Errors fixed:",
-    "Some errors could not be fixed."};
+    "Some errors could not be fixed.",
+    "Shrink partition",
+    "Partition:",
+    "Size:",
+    "New size:"};
 
 #endif
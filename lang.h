@@ -68,6 +68,9 @@ enum SYS_UI_MESSAGES {
     SYS_UI_MSG_ZERO_FILL_DISK_CFM_2,
     SYS_UI_MSG_HDD_CORRUPTED,
     SYS_UI_MSG_HDD_SMART_FAILED,
+    SYS_UI_MSG_DSC_SHRINK_PART,
+    SYS_UI_MSG_SHRINK_PART_CFM,
+    SYS_UI_MSG_NO_SHRINKABLE_PART,
 
     SYS_UI_MSG_COUNT
 };
@@ -120,6 +123,10 @@ enum SYS_UI_LABEL_TEXT {
     SYS_UI_LBL_ERRORS_FOUND,
     SYS_UI_LBL_ERRORS_FIXED,
     SYS_UI_LBL_SOME_ERRORS_NOT_FIXED,
+    SYS_UI_LBL_SHRINK_PART,
+    SYS_UI_LBL_PARTITION,
+    SYS_UI_LBL_PART_SIZE,
+    SYS_UI_LBL_NEW_SIZE,
 
     SYS_UI_LBL_COUNT
 };
@@ -39,6 +39,7 @@ enum MAIN_MENU_ID {
     MAIN_MENU_ID_VERSION,
     MAIN_MENU_ID_BTN_SCAN,
     MAIN_MENU_ID_BTN_OPT,
+    MAIN_MENU_ID_BTN_SHRINK,
     MAIN_MENU_ID_BTN_SURF_SCAN,
     MAIN_MENU_ID_BTN_ZERO_FILL,
     MAIN_MENU_ID_BTN_EXIT,
@@ -55,6 +56,16 @@ enum PRG_SCREEN_ID {
     PRG_SCREEN_ID_TOTAL_PROGRESS,
 };
 
+enum SHRINK_MENU_ID {
+    SHRINK_MENU_ID_PART_INDEX = 1,
+    SHRINK_MENU_ID_PART_NAME,
+    SHRINK_MENU_ID_PART_SIZE,
+    SHRINK_MENU_ID_NEW_SIZE,
+    SHRINK_MENU_ID_BTN_SHRINK,
+};
+
+#define SHRINK_MENU_MAX_PARTITIONS 64
+
 static struct UIMenuItem HDDMainMenuItems[] = {
     {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_ATA_UNIT_0},
     {MITEM_SEPERATOR},
@@ -96,6 +107,9 @@ static struct UIMenuItem HDDMainMenuItems[] = {
     {MITEM_BUTTON, MAIN_MENU_ID_BTN_OPT, MITEM_FLAG_POS_MID, 0, 24, 0, 0, SYS_UI_LBL_OPT_DISK},
     {MITEM_BREAK},
     {MITEM_BREAK},
+    {MITEM_BUTTON, MAIN_MENU_ID_BTN_SHRINK, MITEM_FLAG_POS_MID, 0, 24, 0, 0, SYS_UI_LBL_SHRINK_PART},
+    {MITEM_BREAK},
+    {MITEM_BREAK},
     {MITEM_BUTTON, MAIN_MENU_ID_BTN_SURF_SCAN, MITEM_FLAG_POS_MID, 0, 24, 0, 0, SYS_UI_LBL_SURF_SCAN_DISK},
     {MITEM_BREAK},
     {MITEM_BREAK},
@@ -137,8 +151,45 @@ static struct UIMenuItem ProgressScreenItems[] = {
 
     {MITEM_TERMINATOR}};
 
+static struct UIMenuItem ShrinkMenuItems[] = {
+    {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_SHRINK_PART},
+    {MITEM_SEPERATOR},
+    {MITEM_BREAK},
+
+    {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_PARTITION},
+    {MITEM_TAB},
+    {MITEM_TAB},
+    {MITEM_VALUE, SHRINK_MENU_ID_PART_INDEX, 0, MITEM_FORMAT_UDEC, 2},
+    {MITEM_SPACE},
+    {MITEM_STRING, SHRINK_MENU_ID_PART_NAME, MITEM_FLAG_READONLY},
+    {MITEM_BREAK},
+    {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_PART_SIZE},
+    {MITEM_TAB},
+    {MITEM_TAB},
+    {MITEM_VALUE, SHRINK_MENU_ID_PART_SIZE, MITEM_FLAG_READONLY, MITEM_FORMAT_UDEC},
+    {MITEM_SPACE},
+    {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_MB},
+    {MITEM_BREAK},
+    {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_NEW_SIZE},
+    {MITEM_TAB},
+    {MITEM_TAB},
+    {MITEM_VALUE, SHRINK_MENU_ID_NEW_SIZE, 0, MITEM_FORMAT_UDEC},
+    {MITEM_SPACE},
+    {MITEM_LABEL, 0, 0, 0, 0, 0, 0, SYS_UI_LBL_GB},
+    {MITEM_BREAK},
+    {MITEM_BREAK},
+
+    {MITEM_BUTTON, SHRINK_MENU_ID_BTN_SHRINK, MITEM_FLAG_POS_MID, 0, 24, 0, 0, SYS_UI_LBL_SHRINK_PART},
+    {MITEM_BREAK},
+
+    {MITEM_TERMINATOR}};
+
 static struct UIMenu HDDMainMenu    = {NULL, NULL, HDDMainMenuItems, {{BUTTON_TYPE_SYS_SELECT, SYS_UI_LBL_OK}, {BUTTON_TYPE_SYS_CANCEL, SYS_UI_LBL_QUIT}}};
 static struct UIMenu ProgressScreen = {NULL, NULL, ProgressScreenItems, {{BUTTON_TYPE_SYS_CANCEL, SYS_UI_LBL_CANCEL}, {-1, -1}}};
+static struct UIMenu ShrinkMenu     = {NULL, NULL, ShrinkMenuItems, {{BUTTON_TYPE_SYS_SELECT, SYS_UI_LBL_OK}, {BUTTON_TYPE_SYS_CANCEL, SYS_UI_LBL_CANCEL}}};
+
+static struct ShrinkablePartition ShrinkablePartitions[SHRINK_MENU_MAX_PARTITIONS];
+static int ShrinkMenuPartition; // The partition that the menu currently shows.
 #endif
 
 enum SCAN_RESULTS_SCREEN_ID {
@@ -274,6 +325,9 @@ static int MainMenuUpdateCallback(struct UIMenu *menu, unsigned short int frame,
                 case MAIN_MENU_ID_BTN_OPT:
                     UISetString(menu, MAIN_MENU_ID_DESCRIPTION, GetUIString(SYS_UI_MSG_DSC_OPT_DISK));
                     break;
+                case MAIN_MENU_ID_BTN_SHRINK:
+                    UISetString(menu, MAIN_MENU_ID_DESCRIPTION, GetUIString(SYS_UI_MSG_DSC_SHRINK_PART));
+                    break;
                 case MAIN_MENU_ID_BTN_SURF_SCAN:
                     UISetString(menu, MAIN_MENU_ID_DESCRIPTION, GetUIString(SYS_UI_MSG_DSC_SURF_SCAN_DISK));
                     break;
@@ -293,6 +347,61 @@ static int MainMenuUpdateCallback(struct UIMenu *menu, unsigned short int frame,
     return 0;
 }
 
+// Shows the name and size of the selected partition. The new size may be anything below the current size, in GB.
+static void ShrinkMenuSelectPartition(struct UIMenu *menu, int index)
+{
+    struct UIMenuItem *item;
+    int max;
+
+    UISetString(menu, SHRINK_MENU_ID_PART_NAME, ShrinkablePartitions[index].name);
+    UISetValue(menu, SHRINK_MENU_ID_PART_SIZE, ShrinkablePartitions[index].size);
+
+    max = ((int)ShrinkablePartitions[index].size - 1) / 1024;
+    if (max < 1)
+        max = 1;
+
+    item            = UIGetItem(menu, SHRINK_MENU_ID_NEW_SIZE);
+    item->value.min = 1;
+    item->value.max = max;
+    if (item->value.value < 1 || item->value.value > max)
+        item->value.value = max;
+
+    ShrinkMenuPartition = index;
+}
+
+static int ShrinkMenuUpdateCallback(struct UIMenu *menu, unsigned short int frame, int selection, u32 padstatus)
+{
+    int index;
+
+    if ((index = UIGetValue(menu, SHRINK_MENU_ID_PART_INDEX) - 1) != ShrinkMenuPartition)
+        ShrinkMenuSelectPartition(menu, index);
+
+    return 0;
+}
+
+static void ShrinkPartitionMenu(int unit)
+{
+    struct UIMenuItem *item;
+    int count;
+
+    if ((count = GetShrinkablePartitions(unit, ShrinkablePartitions, SHRINK_MENU_MAX_PARTITIONS)) < 1) {
+        DisplayErrorMessage(SYS_UI_MSG_NO_SHRINKABLE_PART);
+        return;
+    }
+
+    item              = UIGetItem(&ShrinkMenu, SHRINK_MENU_ID_PART_INDEX);
+    item->value.value = 1;
+    item->value.min   = 1;
+    item->value.max   = count;
+    UISetValue(&ShrinkMenu, SHRINK_MENU_ID_NEW_SIZE, 0);
+    ShrinkMenuSelectPartition(&ShrinkMenu, 0);
+
+    if (UIExecMenu(&ShrinkMenu, 0, NULL, &ShrinkMenuUpdateCallback) == SHRINK_MENU_ID_BTN_SHRINK) {
+        if (DisplayPromptMessage(SYS_UI_MSG_SHRINK_PART_CFM, SYS_UI_LBL_CANCEL, SYS_UI_LBL_OK) == 2)
+            ShrinkPartition(unit, ShrinkablePartitions[ShrinkMenuPartition].name, UIGetValue(&ShrinkMenu, SHRINK_MENU_ID_NEW_SIZE) * 1024);
+    }
+}
+
 static int ProcessSpaceValue(u32 space, u32 *ProcessedSpace)
 {
     u32 temp;
@@ -395,6 +504,9 @@ void MainMenu(void)
                 if (DisplayPromptMessage(SYS_UI_MSG_OPT_DISK_CFM, SYS_UI_LBL_CANCEL, SYS_UI_LBL_OK) == 2)
                     OptimizeDisk(0);
                 break;
+            case MAIN_MENU_ID_BTN_SHRINK:
+                ShrinkPartitionMenu(0);
+                break;
             case MAIN_MENU_ID_BTN_SURF_SCAN:
                 if (DisplayPromptMessage(SYS_UI_MSG_SURF_SCAN_DISK_CFM, SYS_UI_LBL_CANCEL, SYS_UI_LBL_OK) == 2)
                     SurfScanDisk(0);
@@ -436,36 +436,32 @@ int ScanDisk(int unit)
     return result;
 }
 
-static int HdskDisk(int unit)
+#define HDSK_RATE_SETTLE_TIME 60 // Seconds before the measured progress rate is used for the ETA.
+
+// Moves the partitions with HDSK, which must be loaded.
+static int HdskRun(int unit)
 {
     char bdevice[] = "hdsk0:";
-    struct hdskStat status;
+    struct hdskEstimate status;
     unsigned int PadStatus, CurrentCPUTicks, PreviousCPUTicks, seconds, TimeElasped, rate;
     int PercentageComplete;
-    int result, InitSemaID;
-    u32 progress;
+    int result;
+    u32 progress, TransferSize;
 
-    InitSemaID = IopInitStart(IOP_MODSET_HDSK);
     bdevice[4] = '0' + unit;
 
-    InitProgressScreen(SYS_UI_LBL_OPTIMIZING_DISK_P2);
-
-    WaitSema(InitSemaID);
-    DeleteSema(InitSemaID);
-
-    SysBootDeviceInit();
-    ReinitializeUI();
+    // Copy in larger blocks if the IOP has the memory for them. Otherwise, HDSK keeps its default.
+    // This is set first, so that the copy rate is measured with the block size that will be used.
+    TransferSize = 1024;
+    fileXioDevctl(bdevice, HDSK_DEVCTL_SET_TRANSFER_SIZE, &TransferSize, sizeof(TransferSize), NULL, 0);
 
-#ifdef LOG_MESSAGES
-    IopStartLog("hdsk.log");
-    printf("# Log generated by HDDChecker v" HDDC_VERSION ", built on "__DATE__
-           " "__TIME__
-           "\n");
-#endif
+    // Now, scan the disk. The estimate also measures the copy rate, which is used until enough time has passed to measure progress.
+    memset(&status, 0, sizeof(status));
+    if ((result = fileXioDevctl(bdevice, HDSK_DEVCTL_GET_ESTIMATE, NULL, 0, &status, sizeof(status))) < 0)
+        result = fileXioDevctl(bdevice, HDSK_DEVCTL_GET_HDD_STAT, NULL, 0, &status, sizeof(struct hdskStat));
 
-    // Now, scan the disk.
-    if ((result = fileXioDevctl(bdevice, HDSK_DEVCTL_GET_HDD_STAT, NULL, 0, &status, sizeof(struct hdskStat))) >= 0) {
-        printf("# hdsk: total: %x, free: %x\n", status.total, status.free);
+    if (result >= 0) {
+        printf("# hdsk: total: %x, free: %x, headers: %u, rate: %u, seconds: %u\n", status.total, status.free, status.headers, status.rate, status.seconds);
 
         if ((status.total > 0) && (result = fileXioDevctl(bdevice, HDSK_DEVCTL_START, NULL, 0, NULL, 0)) == 0) {
             result           = 0;
@@ -480,7 +476,7 @@ static int HdskDisk(int unit)
                     TimeElasped += seconds;
                     PreviousCPUTicks = CurrentCPUTicks;
                 }
-                rate = (TimeElasped > 0) ? progress / TimeElasped : 0; // In sectors/second
+                rate = (TimeElasped >= HDSK_RATE_SETTLE_TIME || status.rate == 0) ? (TimeElasped > 0 ? progress / TimeElasped : 0) : status.rate; // In sectors/second
 
                 DrawDiskOptimizationScreen(PercentageComplete, 50 + PercentageComplete / 2, rate > 0 ? (status.total - progress) / rate : UINT_MAX);
 
@@ -500,6 +496,32 @@ static int HdskDisk(int unit)
         }
     }
 
+    return result;
+}
+
+static int HdskDisk(int unit)
+{
+    int result, InitSemaID;
+
+    InitSemaID = IopInitStart(IOP_MODSET_HDSK);
+
+    InitProgressScreen(SYS_UI_LBL_OPTIMIZING_DISK_P2);
+
+    WaitSema(InitSemaID);
+    DeleteSema(InitSemaID);
+
+    SysBootDeviceInit();
+    ReinitializeUI();
+
+#ifdef LOG_MESSAGES
+    IopStartLog("hdsk.log");
+    printf("# Log generated by HDDChecker v" HDDC_VERSION ", built on "__DATE__
+           " "__TIME__
+           "\n");
+#endif
+
+    result = HdskRun(unit);
+
 #ifdef LOG_MESSAGES
     IopStopLog();
 #endif
@@ -507,14 +529,65 @@ static int HdskDisk(int unit)
     return result;
 }
 
-static int FsskDisk(int unit)
+// Removes the surplus sub-partitions of a PFS partition with FSSK, which must be loaded. done is the number of partitions that were already checked.
+static int FsskPartition(int unit, const char *partition, u32 TargetSize, unsigned int done, unsigned int partitions)
 {
-    char bdevice[] = "hdd0:", cmd[64];
-    iox_dirent_t dirent;
+    char cmd[64];
     struct fsskStatus status;
-    unsigned int PadStatus, CurrentCPUTicks, PreviousCPUTicks, seconds, TimeElasped, rate, partitions, i;
+    unsigned int PadStatus, CurrentCPUTicks, PreviousCPUTicks, seconds, TimeElasped, rate;
     int PercentageComplete;
-    int bfd, fd, result, InitSemaID;
+    int fd, result;
+
+    result = 0;
+    sprintf(cmd, "fssk:hdd%d:%s", unit, partition);
+    if ((fd = fileXioOpen(cmd, 0, FSSK_MODE_VERBOSITY(FSSK_VERBOSITY))) >= 0) {
+        // Only remove the sub-partitions beyond the target size, if there is one.
+        if (TargetSize != 0)
+            fileXioIoctl2(fd, FSSK_IOCTL2_CMD_SET_TARGET_SIZE, &TargetSize, sizeof(TargetSize), NULL, 0);
+
+        if ((result = fileXioIoctl2(fd, FSSK_IOCTL2_CMD_START, NULL, 0, NULL, 0)) == 0) {
+            result           = 0;
+            TimeElasped      = 0;
+            PreviousCPUTicks = cpu_ticks();
+            while (fileXioIoctl2(fd, FSSK_IOCTL2_CMD_POLL, NULL, 0, NULL, 0) == 1) {
+                CurrentCPUTicks = cpu_ticks();
+                if ((seconds = (CurrentCPUTicks > PreviousCPUTicks ? CurrentCPUTicks - PreviousCPUTicks : UINT_MAX - PreviousCPUTicks + CurrentCPUTicks) / 295000000) > 0) {
+                    TimeElasped += seconds;
+                    PreviousCPUTicks = CurrentCPUTicks;
+                }
+                PercentageComplete = (int)((u64)done * 100 / partitions);
+                rate               = (TimeElasped > 0) ? done / TimeElasped : 0; // In partitions/second
+
+                DrawDiskOptimizationScreen(PercentageComplete, PercentageComplete / 2, rate > 0 ? (partitions - done) / rate : UINT_MAX);
+
+                PadStatus = ReadCombinedPadStatus();
+                if (PadStatus & CancelButton) {
+                    if (DisplayPromptMessage(SYS_UI_MSG_OPT_DISK_ABORT_CFM, SYS_UI_LBL_NO, SYS_UI_LBL_YES) == 2) {
+                        fileXioIoctl2(fd, FSSK_IOCTL2_CMD_STOP, NULL, 0, NULL, 0);
+                        result      = 0;
+                        UserAborted = 1;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (result == 0 && (result = fileXioIoctl2(fd, FSSK_IOCTL2_CMD_GET_STATUS, NULL, 0, &status, sizeof(status))) == 0)
+            result = status.hasError;
+
+        fileXioClose(fd);
+    } else
+        result = fd;
+
+    return result;
+}
+
+static int FsskDisk(int unit)
+{
+    char bdevice[] = "hdd0:";
+    iox_dirent_t dirent;
+    unsigned int partitions, i;
+    int bfd, result, InitSemaID;
 
     InitSemaID = IopInitStart(IOP_MODSET_FSSK);
     bdevice[3] = '0' + unit;
@@ -553,43 +626,8 @@ static int FsskDisk(int unit)
             if (!(dirent.stat.attr & APA_FLAG_SUB) && dirent.stat.mode == APA_TYPE_PFS) {
                 printf("# fssk hdd%d:%s\n", unit, dirent.name);
 
-                sprintf(cmd, "fssk:hdd%d:%s", unit, dirent.name);
-                if ((fd = fileXioOpen(cmd, 0, FSSK_MODE_VERBOSITY(FSSK_VERBOSITY))) >= 0) {
-                    if ((result = fileXioIoctl2(fd, FSSK_IOCTL2_CMD_START, NULL, 0, NULL, 0)) == 0) {
-                        result           = 0;
-                        TimeElasped      = 0;
-                        PreviousCPUTicks = cpu_ticks();
-                        while (fileXioIoctl2(fd, FSSK_IOCTL2_CMD_POLL, NULL, 0, NULL, 0) == 1) {
-                            CurrentCPUTicks = cpu_ticks();
-                            if ((seconds = (CurrentCPUTicks > PreviousCPUTicks ? CurrentCPUTicks - PreviousCPUTicks : UINT_MAX - PreviousCPUTicks + CurrentCPUTicks) / 295000000) > 0) {
-                                TimeElasped += seconds;
-                                PreviousCPUTicks = CurrentCPUTicks;
-                            }
-                            PercentageComplete = (int)((u64)i * 100 / partitions);
-                            rate               = (TimeElasped > 0) ? i / TimeElasped : 0; // In partitions/second
-
-                            DrawDiskOptimizationScreen(PercentageComplete, PercentageComplete / 2, rate > 0 ? (partitions - i) / rate : UINT_MAX);
-
-                            PadStatus = ReadCombinedPadStatus();
-                            if (PadStatus & CancelButton) {
-                                if (DisplayPromptMessage(SYS_UI_MSG_OPT_DISK_ABORT_CFM, SYS_UI_LBL_NO, SYS_UI_LBL_YES) == 2) {
-                                    fileXioIoctl2(fd, FSSK_IOCTL2_CMD_STOP, NULL, 0, NULL, 0);
-                                    result      = 0;
-                                    UserAborted = 1;
-                                    break;
-                                }
-                            }
-                        }
-                    }
-
-                    if (result != 0 || (result = fileXioIoctl2(fd, FSSK_IOCTL2_CMD_GET_STATUS, NULL, 0, &status, sizeof(status))) != 0 || (result = status.hasError) != 0 || UserAborted) {
-                        fileXioClose(fd);
-                        break;
-                    }
-
-                    fileXioClose(fd);
-                } else
-                    result = fd;
+                if ((result = FsskPartition(unit, dirent.name, 0, i, partitions)) != 0 || UserAborted)
+                    break;
 
                 putchar('\n');
             }
@@ -637,6 +675,115 @@ int OptimizeDisk(int unit)
     return result;
 }
 
+// Lists the PFS partitions of the unit that have sub-partitions. Returns the number of partitions listed.
+int GetShrinkablePartitions(int unit, struct ShrinkablePartition *partitions, int max)
+{
+    char bdevice[] = "hdd0:";
+    iox_dirent_t dirent;
+    int bfd, count, pass, i, j;
+
+    bdevice[3] = '0' + unit;
+    count      = 0;
+
+    // The main partitions are listed first, as a sub-partition may be located before its main partition.
+    for (pass = 0; pass < 2; pass++) {
+        if ((bfd = fileXioDopen(bdevice)) < 0)
+            break;
+
+        while (fileXioDread(bfd, &dirent) > 0) {
+            if (pass == 0) {
+                if (!(dirent.stat.attr & APA_FLAG_SUB) && dirent.stat.mode == APA_TYPE_PFS && count < max) {
+                    strncpy(partitions[count].name, dirent.name, sizeof(partitions[count].name) - 1);
+                    partitions[count].name[sizeof(partitions[count].name) - 1] = '\0';
+                    partitions[count].size                                     = dirent.stat.size / 2048;
+                    partitions[count].subs                                     = 0;
+                    count++;
+                }
+            } else if (dirent.stat.attr & APA_FLAG_SUB) {
+                // Sub-partitions have the ID of their main partition.
+                for (i = 0; i < count; i++) {
+                    if (strcmp(partitions[i].name, dirent.name) == 0) {
+                        partitions[i].size += dirent.stat.size / 2048;
+                        partitions[i].subs++;
+                        break;
+                    }
+                }
+            }
+        }
+
+        fileXioDclose(bfd);
+    }
+
+    // Only the sub-partitions can be removed.
+    for (i = 0, j = 0; i < count; i++) {
+        if (partitions[i].subs > 0)
+            partitions[j++] = partitions[i];
+    }
+
+    return j;
+}
+
+// Shrinks a PFS partition to about size MB, then compacts the partition table to make the space usable.
+// FSSK and HDSK are loaded together, so there is no IOP reboot in between.
+int ShrinkPartition(int unit, const char *partition, unsigned int size)
+{
+    char bdevice[] = "hdsk0:";
+    int result, InitSemaID;
+
+    WaitSema(InstallLockSema);
+
+    DisplayFlashStatusUpdate(SYS_UI_MSG_PLEASE_WAIT);
+
+    InitSemaID = IopInitStart(IOP_MODSET_SHRINK);
+    bdevice[4] = '0' + unit;
+
+    InitProgressScreen(SYS_UI_LBL_OPTIMIZING_DISK_P1);
+
+    WaitSema(InitSemaID);
+    DeleteSema(InitSemaID);
+
+    SysBootDeviceInit();
+    ReinitializeUI();
+
+#ifdef LOG_MESSAGES
+    IopStartLog("shrink.log");
+    printf("# Log generated by HDDChecker v" HDDC_VERSION ", built on "__DATE__
+           " "__TIME__
+           "\n");
+#endif
+
+    printf("# fssk hdd%d:%s, %u MB\n", unit, partition, size);
+    if ((result = FsskPartition(unit, partition, size, 0, 1)) == 0 && !UserAborted) {
+        // HDSK read the partition table when it was loaded, before FSSK removed the sub-partitions.
+        InitProgressScreen(SYS_UI_LBL_OPTIMIZING_DISK_P2);
+        if ((result = fileXioDevctl(bdevice, HDSK_DEVCTL_RESCAN, NULL, 0, NULL, 0)) == 0)
+            result = HdskRun(unit);
+    }
+
+#ifdef LOG_MESSAGES
+    IopStopLog();
+#endif
+
+    if (result == 0) {
+        if (!UserAborted)
+            DisplayInfoMessage(SYS_UI_MSG_OPT_DISK_COMPLETED_OK);
+    } else
+        DisplayErrorMessage(SYS_UI_MSG_HDD_FAULT);
+
+    DisplayFlashStatusUpdate(SYS_UI_MSG_PLEASE_WAIT);
+    InitSemaID = IopInitStart(IOP_MODSET_MAIN);
+
+    WaitSema(InitSemaID);
+    DeleteSema(InitSemaID);
+
+    SysBootDeviceInit();
+    ReinitializeUI();
+
+    SignalSema(InstallLockSema);
+
+    return result;
+}
+
 int SurfScanDisk(int unit)
 {
     u32 lba, SectorsRemaining, TotalSectors;
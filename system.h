@@ -28,6 +28,14 @@ enum BAD_SECTOR_HANDLING_MODES {
 
     BAD_SECTOR_HANDLING_MODE_COUNT
 };
+
+// A PFS partition that has sub-partitions, which ShrinkPartition can remove.
+struct ShrinkablePartition
+{
+    char name[33];
+    unsigned int size; // In MB, including the sub-partitions.
+    unsigned int subs;
+};
 #endif
 
 int GetBootDeviceID(void);
@@ -37,6 +45,8 @@ int IsPSX(void);
 int ScanDisk(int unit);
 #ifndef FSCK
 int OptimizeDisk(int unit);
+int GetShrinkablePartitions(int unit, struct ShrinkablePartition *partitions, int max);
+int ShrinkPartition(int unit, const char *partition, unsigned int size);
 int SurfScanDisk(int unit);
 int ZeroFillDisk(int unit);
 #endif